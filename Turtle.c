@@ -69,20 +69,22 @@
 */
 
 #include <ctype.h>
+#include <stdlib.h>
 #include <avr/pgmspace.h>
-#include <avr/eeprom.h>
+#include <util/atomic.h>
 #include "Turtle.h"
 #include "platform.h"
 #include "flash.h"
 #include "serialio.h"
 #include "USB.h"
 #include "sd.h"
-
-/** Circular buffer to hold data from the host before it is sent to the device via the serial port. */
-static RingBuffer_t USBtoUSART_Buffer;
-
-/** Underlying data buffer for \ref USBtoUSART_Buffer, where the stored bytes are located. */
-static uint8_t      USBtoUSART_Buffer_Data[64];
+#include "job.h"
+#include "slot.h"
+#include "bitstream.h"
+#include "prod.h"
+#include "script.h"
+#include "stats.h"
+#include "spi.h"
 
 /** LUFA CDC Class driver interface configuration and state information. This structure is
  *  passed to all CDC Class driver functions, so that multiple instances of the same class
@@ -116,28 +118,76 @@ USB_ClassInfo_CDC_Device_t VirtualSerial_CDC_Interface =
 
 FILE fusb;
 FILE *fio;
+static struct {
+	uint8	n;
+	uint8	muted;									// a raw stream is going out, drop text
+	uint8	buf[CDC_TXRX_EPSIZE];
+} sConsole;												// console output collected for a packet
 volatile uint16 gTicks;
+volatile uint16 gClock;								// free running, * 100ms
+volatile uint8 gPowFail;
+volatile uint8 gPowSag;								// set from interrupts, only JobTask() and PowerFail() clear it
+static volatile uint8 sResetTicks;					// FPGA reset pulse countdown
+static volatile uint8 sFpgaRuns;					// FpgaRun() gave up the bus in programmer mode
+static const char sHexDigits[16] PROGMEM = "0123456789ABCDEF";
+static struct {
+	uint8	state;
+	uint8	count;										// ESC_CHARs held back
+	uint16	last;										// Clock() at the last character from the host
+} sEsc;
+
+//-----------------------------------------------------------------------------
+//	Turns the comparator interrupt on for POW_WATCH_CHAN rising. ACIS may only
+//	change with ACIE off, and the change can set ACI, so that's cleared before
+//	ACIE goes on.
+//-----------------------------------------------------------------------------
+static void WatchComparator(void) {
 
+	ACSR = ACSR_ARM;
+	ACSR = ACSR_ARM;									// clear ACI from the change
+	ACSR = ACSR_WATCH;
+}
+
+//-----------------------------------------------------------------------------
+//	Checks each supply rail against the bandgap, then leaves the comparator
+//	watching POW_WATCH_CHAN with its interrupt on. Called every tick.
 //-----------------------------------------------------------------------------
 static void ReadComparator(void) {
 	
-	ACSR = 0b01010000;
-	gFlags.powfail = false;
-	for (uint8 chan = 2; chan < 5; chan++) {
-		if (ACSR & 0x20)
-		gFlags.powfail = true;
+	uint8 fail = false;
+
+	ACSR &= ~(1 << ACIE);								// before ACIS changes
+	ACSR = ACSR_POLL;
+	for (uint8 chan = POW_CHAN_FIRST; chan <= POW_CHAN_LAST; chan++) {
 		ACMUX = chan;
 		asm volatile("nop");
 		asm volatile("nop");
+		if (ACSR & (1 << ACO))							// rail below the bandgap
+			fail = true;
 	}
+	ACMUX = POW_WATCH_CHAN;
+	asm volatile("nop");
+	asm volatile("nop");
+	WatchComparator();
+
+	gPowFail = fail;
 	
-//	if (gFlags.pgmMode)
-//		return;
-	
-	if (!gFlags.powfail)
+	if (fail) {
 //		POW_GOOD_LO;
+		gPowSag = true;
 		gFlags.ledState = LED_FAST;
 //		POW_GOOD_HI;
+	}
+}
+
+//-----------------------------------------------------------------------------
+//	The watched rail has dropped below the bandgap: flash writes stop at the
+//	next page and nothing new starts until a tick finds the rails good again.
+//	The latch has a byte of its own, as the main loop changes gFlags.
+//-----------------------------------------------------------------------------
+ISR(ANALOG_COMP_vect) {
+
+	gPowSag = true;
 }
 
 //-----------------------------------------------------------------------------
@@ -151,6 +201,7 @@ ISR(TIMER1_COMPA_vect) {
 	static uint8 buttCounter = 0;
 	
 	TIFR1 |= 2;							// clear irq flag
+	gClock++;
 	
 	switch (gFlags.buttonState) {
 		case BUTT_IDLE:
@@ -182,6 +233,10 @@ ISR(TIMER1_COMPA_vect) {
 			break;
 	}
 	
+	// end the FPGA reset pulse, unless programmer mode has taken over the reset line
+	if (sResetTicks && !--sResetTicks && (!gFlags.pgmMode || sFpgaRuns))
+		FPGA_RELEASE;
+
 	ReadComparator();
 
 	// that's it for normal mode
@@ -223,14 +278,27 @@ ISR(TIMER1_COMPA_vect) {
 	}
 }
 
+//-----------------------------------------------------------------------------
+//	Returns the free running clock, in ticks
+//-----------------------------------------------------------------------------
+uint16 Clock(void) {
+
+	uint16 t;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		t = gClock;
+	}
+	return t;
+}
+
 //-----------------------------------------------------------------------------
 //	Called when SW1 pressed or released
+//	Starts the FPGA reset pulse, the timer interrupt ends it
 //-----------------------------------------------------------------------------
 ISR(PCINT1_vect) {
 
 	FPGA_RESET;
-	Delay_MS(200);
-	FPGA_RELEASE;
+	sResetTicks = FPGA_RESET_TICKS;		// (re)start the pulse
 	
 	PCIFR = 2;							// clear interrupt
 }
@@ -279,7 +347,9 @@ void SetupHardware(void) {
 	SerialInit(true);
 	
 	// Init comparator
-	ACSR = 0b01010000;
+	ACMUX = POW_WATCH_CHAN;
+	ACSR = ACSR_POLL;
+	WatchComparator();
 //	DIDR1 = 0b01110000;
 	
 	// interrupt when SW1 (C6 = INT8) pressed
@@ -310,14 +380,14 @@ void WaitForBytes(void) {
 }
 
 //-----------------------------------------------------------------------------
-//	Waits until a character is available
+//	Waits until a character is available, a running job carries on meanwhile
 //-----------------------------------------------------------------------------
 uint8 USBgetch(char *c) {
 	
 	int16	x;
 	
 	do {
-		HandleUsb();
+		BackgroundTasks();
 	} while ((x = CDC_Device_ReceiveByte(&VirtualSerial_CDC_Interface)) < 0);
 	
 	*c = (char)(lsb(x));
@@ -326,43 +396,345 @@ uint8 USBgetch(char *c) {
 }
 
 //-----------------------------------------------------------------------------
-//	Waits until a character is available
+//	Hands the console output collected so far to the IN endpoint. The
+//	endpoint sends it when its bank is full, or when HandleUsb() flushes it.
+//-----------------------------------------------------------------------------
+static void ConsoleFlush(void) {
+
+	if (!sConsole.n)
+		return;
+	if (USB_DeviceState == DEVICE_STATE_Configured) {
+		Endpoint_SelectEndpoint(VirtualSerial_CDC_Interface.Config.DataINEndpoint.Address);
+		Endpoint_Write_Stream_LE(sConsole.buf, sConsole.n, NULL);
+	}
+	sConsole.n = 0;
+}
+
+//-----------------------------------------------------------------------------
+//	Put function of the fio stream, collects a packet's worth before going
+//	near the endpoint
+//-----------------------------------------------------------------------------
+static int ConsolePut(char c, FILE *stream) {
+
+	if (sConsole.muted)
+		return 0;
+	sConsole.buf[sConsole.n++] = c;
+	if (sConsole.n == sizeof(sConsole.buf))
+		ConsoleFlush();
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+uint8 USBputch(char c) {
+
+	ConsolePut(c, fio);
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+//	Sends a PROGMEM string straight from flash, without going through the stream
+//-----------------------------------------------------------------------------
+void USBputs_P(PGM_P p) {
+
+	ConsoleFlush();
+	if (sConsole.muted || USB_DeviceState != DEVICE_STATE_Configured)
+		return;
+	Endpoint_SelectEndpoint(VirtualSerial_CDC_Interface.Config.DataINEndpoint.Address);
+	Endpoint_Write_PStream_LE(p, strlen_P(p), NULL);
+}
+
+//-----------------------------------------------------------------------------
+//	Drops console text while on, so nothing lands in the middle of a raw
+//	stream going to the host
+//-----------------------------------------------------------------------------
+void ConsoleMute(uint8 on) {
+
+	ConsoleFlush();
+	sConsole.muted = on;
+}
+
+//-----------------------------------------------------------------------------
+//	Sends n bytes to the host as they are, in full packets. Returns false if
+//	the host stops taking them.
+//-----------------------------------------------------------------------------
+uint8 USBwrite(const uint8 *buf, uint16 n) {
+
+	ConsoleFlush();
+	if (USB_DeviceState != DEVICE_STATE_Configured)
+		return false;
+	Endpoint_SelectEndpoint(VirtualSerial_CDC_Interface.Config.DataINEndpoint.Address);
+
+	return Endpoint_Write_Stream_LE(buf, n, NULL) == ENDPOINT_RWSTREAM_NoError;
+}
+
+//-----------------------------------------------------------------------------
+//	Puts the two hex digits of b at p
+//-----------------------------------------------------------------------------
+static char *HexByte(char *p, uint8 b) {
+
+	*p++ = pgm_read_byte(&sHexDigits[b >> 4]);
+	*p++ = pgm_read_byte(&sHexDigits[b & 0x0F]);
+
+	return p;
+}
+
+//-----------------------------------------------------------------------------
+//	Sends a line of a hex dump, the address then n bytes, up to
+//	HEX_LINE_BYTES, in hex and ASCII. The line is built whole and sent as
+//	one block rather than a printf per byte. Returns false if it can't be.
+//-----------------------------------------------------------------------------
+uint8 HexLine(uint32 addr, const uint8 *buf, uint8 n) {
+
+	char line[HEX_LINE_SIZE];
+	char *p = line;
+	uint8 i;
+
+	for (i = 4; i; i--)
+		p = HexByte(p, addr >> ((i - 1) * 8));
+	*p++ = ':';
+	for (i = 0; i < HEX_LINE_BYTES; i++) {
+		*p++ = ' ';
+		if (i < n)
+			p = HexByte(p, buf[i]);
+		else {
+			*p++ = ' ';
+			*p++ = ' ';
+		}
+	}
+	*p++ = ' ';
+	*p++ = ' ';
+	for (i = 0; i < n; i++)
+		*p++ = isprint(buf[i]) ? buf[i] : '.';
+	*p++ = '\r';
+	*p++ = '\n';
+	return USBwrite((uint8 *)line, p - line);
+}
+
+//-----------------------------------------------------------------------------
+//	Waits until a character is available, from the script line if one is
+//	running
 //-----------------------------------------------------------------------------
 uint8 Getch(char *c) {
 
+	if (ScriptGetch(c))
+		return true;
 	return USBgetch(c);
 }
 
+//-----------------------------------------------------------------------------
+//	Reads one argument, up to a space or the end of the line, with echo and
+//	backspace. Returns its length.
+//-----------------------------------------------------------------------------
+uint8 GetArg(char *buf, uint8 size) {
+
+	uint8 n = 0;
+	char c;
+
+	for (;;) {
+		Getch(&c);
+		if ((c == ' ') && !n)								// leading spaces
+			continue;
+		if ((c == '\r') || (c == '\n') || (c == ' '))
+			break;
+		if ((c == '\b') || (c == 0x7F)) {
+			if (n) {
+				n--;
+				fputs_P(PSTR("\b \b"), fio);
+			}
+		} else if ((n < size - 1) && isprint(c)) {
+			buf[n++] = c;
+			fputc(c, fio);
+		}
+	}
+	buf[n] = '\0';
+	fputs_P(PSTR("\r\n"), fio);
+	return n;
+}
+
+//-----------------------------------------------------------------------------
+//	Asks for a slot number, returns SLOT_COUNT if it isn't one
+//-----------------------------------------------------------------------------
+static uint8 GetSlot(void) {
+
+	char c;
+
+	fputs_P(PSTR("Slot: "), fio);
+	do
+		Getch(&c);
+	while (c == ' ');
+	fputc(c, fio);
+	fputs_P(PSTR("\r\n"), fio);
+	return ((c >= '0') && (c < '0' + SLOT_COUNT)) ? c - '0' : SLOT_COUNT;
+}
+
+//-----------------------------------------------------------------------------
+//	Asks for a hex number
+//-----------------------------------------------------------------------------
+static uint32 GetHex(PGM_P prompt) {
+
+	char s[10];
+
+	fputs_P(prompt, fio);
+	GetArg(s, sizeof(s));
+	return strtoul(s, 0, 16);
+}
+
 //-----------------------------------------------------------------------------
 void PrintHelp(void) {
 	
-	fputs_P(PSTR("\r\n\r\nTurtle FPGA Programmer\r\n"), fio);
-	fputs_P(PSTR("======================\r\n\r\n"), fio);
-	fputs_P(PSTR("Commands:\r\n"), fio);
-	fputs_P(PSTR("\tB\tverify FPGA configuration erased\r\n"), fio);
-	fputs_P(PSTR("\tD\tput into DFU mode for upgrading this firmware\r\n"), fio);
-	fputs_P(PSTR("\tE\terase FPGA configuration\r\n"), fio);
-	fputs_P(PSTR("\tH\tprint this help message\r\n"), fio);
-	fputs_P(PSTR("\tM\tmount SD card\r\n"), fio);
-	fputs_P(PSTR("\tU\tunmount SD card\r\n"), fio);
-	fputs_P(PSTR("\tV\tverify FPGA configuration against SD card\r\n"), fio);
-	fputs_P(PSTR("\tW\twrite FPGA configuration from SD card\r\n"), fio);
-	fputs_P(PSTR("\tX\texit programmer mode and run\r\n"), fio);
+	USBputs_P(PSTR("\r\n\r\nTurtle FPGA Programmer\r\n"));
+	USBputs_P(PSTR("======================\r\n\r\n"));
+	USBputs_P(PSTR("Commands:\r\n"));
+	USBputs_P(PSTR("\tA\tabort the running command\r\n"));
+	USBputs_P(PSTR("\tB\tverify FPGA configuration erased\r\n"));
+	USBputs_P(PSTR("\tC\tCRC of a flash range\r\n"));
+	USBputs_P(PSTR("\tD\tput into DFU mode for upgrading this firmware\r\n"));
+	USBputs_P(PSTR("\tE\terase FPGA configuration\r\n"));
+	USBputs_P(PSTR("\tF\tlist the images in /FPGA and pick one for W, V and O\r\n"));
+	USBputs_P(PSTR("\tG\tactivate a slot, the FPGA boots it from then on\r\n"));
+	USBputs_P(PSTR("\tH\tprint this help message\r\n"));
+	USBputs_P(PSTR("\tI\tshow the configuration flash part and SD read errors\r\n"));
+#if SPI_BENCH
+	USBputs_P(PSTR("\tJ\ttime SPI transfers polled and by interrupt\r\n"));
+#endif
+	USBputs_P(PSTR("\tK\terase a flash range\r\n"));
+	USBputs_P(PSTR("\tL\tlist the configuration slots\r\n"));
+	USBputs_P(PSTR("\tM\tmount SD card\r\n"));
+	USBputs_P(PSTR("\tO\twrite a file from SD card into a slot\r\n"));
+	USBputs_P(PSTR("\tP\tprint a flash range in hex\r\n"));
+	USBputs_P(PSTR("\tQ\tresume an interrupted write\r\n"));
+	USBputs_P(PSTR("\tR\trun the commands in " SCRIPT_FILE "\r\n"));
+	USBputs_P(PSTR("\tS\tshow progress of the running command\r\n"));
+	USBputs_P(PSTR("\tT\tshow the programming times and counts kept in EEPROM\r\n"));
+	USBputs_P(PSTR("\tU\tunmount SD card\r\n"));
+	USBputs_P(PSTR("\tV\tverify FPGA configuration against SD card\r\n"));
+	USBputs_P(PSTR("\tW\twrite FPGA configuration from SD card (fpga.rle, fpga.bit or fpga.bin)\r\n"));
+	USBputs_P(PSTR("\tX\texit programmer mode and run\r\n"));
+	USBputs_P(PSTR("\tY\tsave the flash to " BACKUP_FILE " on the SD card\r\n"));
+	USBputs_P(PSTR("\tZ\tsend a flash range to the host as binary\r\n"));
 }
 
 //-----------------------------------------------------------------------------
 //	Short press from run mode gets you to programmer mode, for use with console menu.
+//	Long commands start a job and return, only A, H and S are accepted
+//	until the job, or the script, finishes.
 //-----------------------------------------------------------------------------
 void ProcessCommand(char command) {
 	
+	command = toupper(command);
+
+	if (JobBusy() || ScriptRunning()) {
+		switch (command) {
+			case 'A':
+				JobAbort();
+				ScriptStop();
+				break;
+
+			case 'S':
+				ScriptStatus();
+				JobStatus();
+				break;
+
+			case 'H':
+				PrintHelp();
+				break;
+
+			default:
+				fputs_P(PSTR("Busy - S for status, A to abort\r\n"), fio);
+				break;
+		}
+		return;
+	}
+
+	RunCommand(command);
+}
+
+//-----------------------------------------------------------------------------
+//	Gives up the card and the SPI bus and lets the FPGA run, at the end of an
+//	escaped command. The UART was never stopped, so what the FPGA sent in
+//	the meantime is still buffered.
+//-----------------------------------------------------------------------------
+static void ReleaseBus(void) {
+
+	pf_mount(false);
+	SpiInit(false);															// release the SPI bus
+	gFlags.pgmMode = false;
+	sFpgaRuns = false;
+	DEBUG_LO;
+}
+
+//-----------------------------------------------------------------------------
+//	Leaves programmer mode for X, starting the UART bridge again
+//-----------------------------------------------------------------------------
+static void LeaveProgrammer(void) {
+
+	ReleaseBus();
+	SerialInit(true);
+}
+
+//-----------------------------------------------------------------------------
+//	Takes over the SPI bus, which holds the FPGA in reset, and mounts the card
+//-----------------------------------------------------------------------------
+static void TakeBus(void) {
+
+	sFpgaRuns = false;
+	SpiInit(true);
+	if (pf_mount(true) == FR_OK)
+		BitIndex();
+}
+
+//-----------------------------------------------------------------------------
+//	Gives up the bus and pulses the FPGA reset, so the FPGA configures from
+//	the flash and runs, without leaving programmer mode
+//-----------------------------------------------------------------------------
+void FpgaRun(void) {
+
+	pf_mount(false);
+	SpiInit(false);
+	sFpgaRuns = true;
+	FPGA_RESET;
+	sResetTicks = FPGA_RESET_TICKS;
+}
+
+//-----------------------------------------------------------------------------
+//	Takes the bus back after FpgaRun(), before anything uses the card or the
+//	flash
+//-----------------------------------------------------------------------------
+void FpgaHold(void) {
+
+	if (sFpgaRuns)
+		TakeBus();
+}
+
+//-----------------------------------------------------------------------------
+//	Runs a command from the console or a script, arguments come from Getch()
+//-----------------------------------------------------------------------------
+void RunCommand(char command) {
+
+	command = toupper(command);
 	gFlags.error = false;
 	gFlags.ledState = LED_MED;
+	if (!strchr_P(PSTR(ESC_LOCAL), command))
+		FpgaHold();
 	
-	switch (toupper(command)) {
+	switch (command) {
+		case 'A':
+		case 'S':
+			fputs_P(PSTR("Nothing running\r\n"), fio);
+			break;
+
 		case 'B':
 			CheckBlank();
-			gFlags.ledState = LED_IDLE;
 			break;
+
+		case 'C': {
+			uint32 start = GetHex(PSTR("Start: "));
+
+			CfgHash(start, GetHex(PSTR("Length: ")));
+			break;
+		}
 		
 		case 'D':
 			fputs_P(PSTR("This will start the firmware upgrade process,\r\npress 'c' to continue, any other key to cancel\r\n"), fio);
@@ -393,26 +765,87 @@ void ProcessCommand(char command) {
 
 		case 'E':
 			EraseFlash();
-			gFlags.ledState = LED_IDLE;
 			break;
 		
+		case 'F': {
+			char s[4];
+
+			BitList();
+			fputs_P(PSTR("Image number: "), fio);
+			if (GetArg(s, sizeof(s)) && (gFlags.error = BitSelect(atoi(s))))
+				fputs_P(PSTR("No such image\r\n"), fio);
+			break;
+		}
+
+		case 'G':
+			gFlags.error = SlotActivate(GetSlot());
+			break;
+
+		case 'I':
+			FlashInfo();
+			SdInfo();
+			SpiInfo();
+			break;
+
+#if SPI_BENCH
+		case 'J':
+			SpiBench();
+			break;
+#endif
+
+		case 'K': {
+			uint32 start = GetHex(PSTR("Start: "));
+
+			EraseRange(start, GetHex(PSTR("End: ")));
+			break;
+		}
+
+		case 'L':
+			SlotList();
+			break;
+
 		case 'M':
 			fputs_P(PSTR("Mounting SD drive\r\n"), fio);
 			if (gFlags.sdOk)
 				fputs_P(PSTR("SD drive already mounted!\r\n"), fio);
-			else
-				pf_mount(true);													// mount SD card
+			else if (pf_mount(true) == FR_OK)									// mount SD card
+				BitIndex();
+			gFlags.error = !gFlags.sdOk;
 			if (gFlags.sdOk)
 				gFlags.ledState = LED_IDLE;
 			else
 				gFlags.ledState = LED_FAST;
 			break;
 
-		case 'P':
-			ExtReadFlash();
+		case 'O': {
+			char name[13];
+			uint8 slot = GetSlot();
+
+			fputs_P(PSTR("File (Enter for the default): "), fio);
+			gFlags.error = GetArg(name, sizeof(name)) ? SlotWrite(slot, name) : SlotWrite(slot, 0);
+			break;
+		}
+
+		case 'Q':
+			gFlags.error = CfgResume();
+			break;
+
+		case 'R':
+			gFlags.error = ScriptStart();
+			break;
+
+		case 'P': {
+			uint32 start = GetHex(PSTR("Start: "));
+
+			ExtReadFlash(start, GetHex(PSTR("Length: ")));
 			gFlags.ledState = LED_IDLE;
 			break;
+		}
 		
+		case 'T':
+			StatList();
+			break;
+
 		case 'U':
 			fputs_P(PSTR("Unmounting SD drive\r\n"), fio);
 			pf_mount(false);													// unmount SD card
@@ -420,47 +853,248 @@ void ProcessCommand(char command) {
 			break;
 
 		case 'V':
-			CfgVerify();
-			gFlags.ledState = LED_IDLE;
+			gFlags.error = CfgVerify();
 			break;
 
 		case 'W':
-			gFlags.error |=  CfgCopy();
-			gFlags.ledState = LED_IDLE;
+			gFlags.error |=  CfgCopy(0, 0, gFlash.capacity, false, 0);
 			break;
 
 		case 'X':
-			pf_mount(false);
 //			InitTimers(false);
-			SpiInit(false);															// release the SPI bus
-			SerialInit(true);
-			Delay_MS(1000);
 			fputs_P(PSTR("changing to run mode\r\n"), fio);
-			gFlags.pgmMode = false;
-			DEBUG_LO;
+			LeaveProgrammer();
+			break;
+
+		case 'Y':
+			gFlags.error = CfgBackup();
 			break;
 
+		case 'Z': {
+			uint32 start = GetHex(PSTR("Start: "));
+
+			CfgDump(start, GetHex(PSTR("Length: ")));
+			break;
+		}
+
 		case 'H':
 		default:
 			PrintHelp();
-			gFlags.ledState = LED_IDLE;
 			break;
 	}
+
+	// a job sets the LED when it finishes
+	if ((gFlags.ledState == LED_MED) && !JobBusy())
+		gFlags.ledState = LED_IDLE;
 }
 
 //-----------------------------------------------------------------------------
 void HandleUsb(void) {
 	
+	ConsoleFlush();
 	CDC_Device_USBTask(&VirtualSerial_CDC_Interface);
 	USB_USBTask();
 }
 
+//-----------------------------------------------------------------------------
+//	Takes over the SPI bus and mounts the card, starts a production run if
+//	the card has an autorun file
+//-----------------------------------------------------------------------------
+static void EnterProgrammer(void) {
+
+	gFlags.pgmMode = true;
+	fputs_P(PSTR("\r\nChanging to programmer mode\r\n"), fio);
+	HandleUsb();
+	SerialInit(false);
+//	InitTimers(true);
+	SpiInit(true);														// take over the SPI bus
+	fputs_P(PSTR("Mounting SD drive\r\n"), fio);
+	if (pf_mount(true) == FR_OK)										// mount SD card
+		BitIndex();
+	PrintHelp();
+	HandleUsb();
+	if (!gFlags.sdOk)
+		gFlags.ledState = LED_FAST;
+	else
+		gFlags.ledState = LED_IDLE;
+	if (!SlotRepair() && ProdAutorun())
+		ProdStart();
+}
+
+//-----------------------------------------------------------------------------
+//	Mode changes from the button. A long press starts a production run,
+//	from either mode.
+//-----------------------------------------------------------------------------
+static void ButtonTask(void) {
+
+	if (!gFlags.pgmMode && gFlags.shortPress) {								// enter program mode on button press
+		gFlags.shortPress = false;
+		EnterProgrammer();
+	}
+
+	if (gFlags.longPress) {
+		gFlags.longPress = false;
+		if (!gFlags.pgmMode)
+			EnterProgrammer();
+		if (!JobBusy())
+			ProdStart();
+	}
+
+	if (gFlags.pgmMode) {
+		if (gFlags.shortPress) {											// exit program mode on button press
+			gFlags.shortPress = false;
+			if (JobBusy())													// or stop the running job
+				JobAbort();
+			else
+				ProcessCommand('X');
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+//	Sends a character from the host to the FPGA, holding back what may be an
+//	escape sequence
+//-----------------------------------------------------------------------------
+static void PassThrough(char c) {
+
+	uint16 quiet = Clock() - sEsc.last;
+
+	sEsc.last = Clock();
+	if ((c == ESC_CHAR) && (sEsc.count < ESC_COUNT) && (sEsc.count || (quiet >= ESC_GUARD))) {
+		sEsc.count++;
+		return;
+	}
+	if (!sEsc.count) {
+		UartPutch(c);
+		return;
+	}
+	for ( ; sEsc.count; sEsc.count--)									// it wasn't one
+		UartPut(ESC_CHAR, &fuart);
+	UartPut(c, &fuart);
+}
+
+//-----------------------------------------------------------------------------
+//	Runs the command after an escape sequence. Only ESC_LOCAL commands are
+//	run without taking over the SPI bus, which holds the FPGA in reset.
+//-----------------------------------------------------------------------------
+static void EscapeCommand(char c) {
+
+	sEsc.state = ESC_RUN;
+	if (!strchr_P(PSTR(ESC_LOCAL), toupper(c))) {
+		gFlags.pgmMode = true;
+		TakeBus();
+	}
+	ProcessCommand(c);
+}
+
+//-----------------------------------------------------------------------------
+//	Spots the end of an escape sequence, and goes back to pass-through when
+//	the command it ran has finished
+//-----------------------------------------------------------------------------
+static void EscapeTask(void) {
+
+	switch (sEsc.state) {
+		case ESC_IDLE:
+			if (!sEsc.count || (Clock() - sEsc.last < ESC_GUARD))
+				break;
+			if (sEsc.count < ESC_COUNT) {								// too few, send them on
+				for ( ; sEsc.count; sEsc.count--)
+					UartPut(ESC_CHAR, &fuart);
+				break;
+			}
+			sEsc.count = 0;
+			sEsc.state = ESC_WAIT;
+			fputs_P(PSTR("\r\nOK\r\n"), fio);
+			break;
+
+		case ESC_WAIT:
+			if (Clock() - sEsc.last >= ESC_TIMEOUT)
+				sEsc.state = ESC_IDLE;
+			break;
+
+		case ESC_RUN:
+			if (JobBusy() || ScriptRunning())
+				break;
+			if (gFlags.pgmMode)											// unless it was X
+				ReleaseBus();
+			sEsc.state = ESC_IDLE;
+			fputs_P(PSTR("\r\nOK\r\n"), fio);
+			break;
+	}
+}
+
+//-----------------------------------------------------------------------------
+//	Characters from USB are commands in programmer mode, otherwise they go to the UART
+//-----------------------------------------------------------------------------
+static void CommandTask(void) {
+
+	int16 rxByte;
+
+	if (TxBufFull())															// only take a character if there's room for it in the UART tx buffer
+		return;
+
+	if ((rxByte = CDC_Device_ReceiveByte(&VirtualSerial_CDC_Interface)) < 0)	// get character if there is one
+		return;
+
+	if (gFlags.pgmMode)
+		ProcessCommand(rxByte);
+	else if (sEsc.state == ESC_WAIT)
+		EscapeCommand(rxByte);
+	else																		// pass-through mode
+		PassThrough(rxByte);
+}
+
+//-----------------------------------------------------------------------------
+//	Characters from the UART go to USB in pass-through mode
+//-----------------------------------------------------------------------------
+static void BridgeTask(void) {
+
+	uint16 BufferCount;
+	char c;
+
+	if (gFlags.pgmMode || !(BufferCount = UartChars()))
+		return;
+	ConsoleFlush();												// keep the order
+
+	Endpoint_SelectEndpoint(VirtualSerial_CDC_Interface.Config.DataINEndpoint.Address);
+
+	// Check if a packet is already enqueued to the host - if so, we shouldn't try to send more data
+	// until it completes as there is a chance nothing is listening and a lengthy timeout could occur 
+	if (Endpoint_IsINReady()) {
+		// Never send more than one bank size less one byte to the host at a time, so that we don't block
+		// while a Zero Length Packet (ZLP) to terminate the transfer is sent if the host isn't listening 
+		uint8_t BytesToSend = MIN(BufferCount, (CDC_TXRX_EPSIZE - 1));
+
+		// Read bytes from the USART receive buffer into the USB IN endpoint
+		while (BytesToSend--) {
+			// Try to send the next byte of data to the host, abort if there is an error without dequeuing
+			if (!UartGetch(&c))
+				break;
+			if (CDC_Device_SendByte(&VirtualSerial_CDC_Interface, c) != ENDPOINT_READYWAIT_NoError)
+				break;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+//	Everything that must keep running while a command waits for input
+//-----------------------------------------------------------------------------
+void BackgroundTasks(void) {
+
+	BridgeTask();
+	JobTask();
+	HandleUsb();
+}
+
 //-----------------------------------------------------------------------------
 //	The UART to the FPGA uses fput(&fuart) etc
 //	The USB serial port uses fput(&fusb) etc which I redirected as fio
 //	It should be possible to access the USB serial port using stdin / stdout but flaky things happen when you try -
 //		puts() and putc() work but not printf
 //		Don't mess with it, you will go insane
+//
+//	The main loop is a round robin of tasks that each do a little work and return.
+//	Long commands run as jobs, see job.c
 //-----------------------------------------------------------------------------
 int main(void) {
 	
@@ -471,85 +1105,21 @@ int main(void) {
 		booty();										// jump to bootloader
 	
 	// normal start
-	int16 rxByte;
-	uint16 BufferCount;
-	char c;
-	
 	SetupHardware();
 
 	fio = &fusb;
 	
-	RingBuffer_InitBuffer(&USBtoUSART_Buffer, USBtoUSART_Buffer_Data, sizeof(USBtoUSART_Buffer_Data));
-	CDC_Device_CreateStream(&VirtualSerial_CDC_Interface, &fusb);
+	fusb = (FILE)FDEV_SETUP_STREAM(ConsolePut, NULL, _FDEV_SETUP_WRITE);
 	
 	gFlags.pgmMode = false;
 	GlobalInterruptEnable();
 	
 	for (;;) {
-		// check mode
-		if (!gFlags.pgmMode && gFlags.shortPress) {								// enter program mode on button press
-			gFlags.shortPress = false;
-			gFlags.pgmMode = true;
-			fputs_P(PSTR("\r\nChanging to programmer mode\r\n"), fio);
-			HandleUsb();
-			SerialInit(false);
-//			InitTimers(true);
-			SpiInit(true);														// take over the SPI bus
-			fputs_P(PSTR("Mounting SD drive\r\n"), fio);
-			pf_mount(true);														// mount SD card
-			PrintHelp();
-			HandleUsb();
-			if (!gFlags.sdOk)
-				gFlags.ledState = LED_FAST;
-			else
-				gFlags.ledState = LED_IDLE;
-		}
-		
-		if (gFlags.pgmMode) {
-			if (gFlags.shortPress) {											// exit program mode on button press
-				gFlags.shortPress = false;
-				ProcessCommand('X');
-			}
-
-			// check for long button press
-			if (gFlags.longPress) {
-				gFlags.longPress = false;
-			}
-		}
-
-
-		// check incoming characters from USB
-		if (!TxBufFull()) {																// look for character if there's room for it in the UART tx buffer
-			if ((rxByte = CDC_Device_ReceiveByte(&VirtualSerial_CDC_Interface)) >= 0) {	// get character if there is one
-				if (gFlags.pgmMode)
-					ProcessCommand(rxByte);
-				else																	// pass-through mode
-					UartPutch(rxByte);
-			}
-		}
-
-		// check characters from UART
-		if (!gFlags.pgmMode && (BufferCount = UartChars())) {
-			Endpoint_SelectEndpoint(VirtualSerial_CDC_Interface.Config.DataINEndpoint.Address);
-
-			// Check if a packet is already enqueued to the host - if so, we shouldn't try to send more data
-			// until it completes as there is a chance nothing is listening and a lengthy timeout could occur 
-			if (Endpoint_IsINReady()) {
-				// Never send more than one bank size less one byte to the host at a time, so that we don't block
-				// while a Zero Length Packet (ZLP) to terminate the transfer is sent if the host isn't listening 
-				uint8_t BytesToSend = MIN(BufferCount, (CDC_TXRX_EPSIZE - 1));
-
-				// Read bytes from the USART receive buffer into the USB IN endpoint
-				while (BytesToSend--) {
-					// Try to send the next byte of data to the host, abort if there is an error without dequeuing
-					if (!UartGetch(&c))
-						break;
-					if (CDC_Device_SendByte(&VirtualSerial_CDC_Interface, c) != ENDPOINT_READYWAIT_NoError)
-						break;
-				}
-			}
-		}
-		HandleUsb();
+		ButtonTask();
+		CommandTask();
+		EscapeTask();
+		ScriptTask();
+		BackgroundTasks();
 	}
 }
 
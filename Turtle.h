@@ -44,13 +44,15 @@
 #define TICK_FREQ			10
 
 extern volatile uint16 gTicks;
+extern volatile uint16 gClock;
+extern volatile uint8 gPowFail;				// a rail was low at the last tick
+extern volatile uint8 gPowSag;				// a rail has dropped, kept until acted on
 struct {
 	volatile uint8	tick			: 1;
 	volatile uint8	buttonState		: 2;
 	volatile uint8	ledState		: 2;
 	volatile uint8	shortPress		: 1;
 	volatile uint8	longPress		: 1;
-	volatile uint8	powfail			: 1;
 	uint8			pgmMode			: 1;
 	uint8			sdOk			: 1;
 	uint8			error			: 1;
@@ -70,6 +72,37 @@ struct {
 
 #define BUTT_LONG		12					// length of a long button press
 
+// A hex dump line is "AAAAAAAA:" then " XX" per byte, two spaces, the ASCII and CR LF
+#define HEX_LINE_BYTES	16
+#define HEX_LINE_SIZE	(9 + 3 * HEX_LINE_BYTES + 2 + HEX_LINE_BYTES + 2)
+
+// In-band escape from pass-through, modem style: ESC_GUARD with nothing from
+// the host, ESC_COUNT ESC_CHARs, then ESC_GUARD with nothing again. The next
+// character is run as a programmer command, then it's back to pass-through.
+#define ESC_CHAR		'+'
+#define ESC_COUNT		3
+#define ESC_GUARD		TICK_FREQ			// 1s
+#define ESC_TIMEOUT		(10 * TICK_FREQ)	// for the command to come
+#define ESC_LOCAL		"HST"				// commands that leave the FPGA running
+
+// escape states
+#define ESC_IDLE		0
+#define ESC_WAIT		1					// for the command
+#define ESC_RUN			2					// until its job or script finishes
+
+// Supply monitor: the comparator has the bandgap on its + input and the rails,
+// divided down, on ACMUX channels POW_CHAN_FIRST to POW_CHAN_LAST
+#define POW_CHAN_FIRST	2
+#define POW_CHAN_LAST	4
+#define POW_WATCH_CHAN	2					// rail watched between ticks
+#define ACSR_POLL		0b01010000			// ACBG, clear ACI
+#define ACSR_ARM		0b01010011			// ACBG, clear ACI, ACO rising, no ACIE yet
+#define ACSR_WATCH		0b01011011			// ACBG, clear ACI, ACIE on ACO rising
+
+// FPGA reset pulse, started by the reset request pin and ended by the timer
+#define FPGA_RESET_MS		200				// minimum pulse width
+#define FPGA_RESET_TICKS	(FPGA_RESET_MS / (1000 / TICK_FREQ) + 1)	// +1 for the partial first tick
+
 //#define E2_DFU			(uint8 *)10
 //#define DFU				0x69
 
@@ -86,9 +119,18 @@ void EVENT_USB_Device_ControlRequest(void);
 void EVENT_CDC_Device_LineEncodingChanged(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo);
 
 uint8_t USBgetch(char *c);
+uint8	USBwrite(const uint8 *buf, uint16 n);
+void	ConsoleMute(uint8 on);
+uint8	HexLine(uint32 addr, const uint8 *buf, uint8 n);
 uint8_t USBputch(char c);
 uint8_t Getch(char *c);
+uint8	GetArg(char *buf, uint8 size);
+void	RunCommand(char command);
+void	FpgaRun(void);
+void	FpgaHold(void);
 void	HandleUsb(void);
+void	BackgroundTasks(void);
+uint16	Clock(void);
 void	USBputs_P(PGM_P p);
 void	WaitForBytes(void);
 		
@@ -0,0 +1,397 @@
+//-----------------------------------------------------------------------------
+//	Turtle Board Atmel Code
+//	bitstream.c
+//	Reads the FPGA configuration from the SD card: the run length compressed
+//	image, which is decoded as it is read, a Xilinx .bit file, whose header
+//	is checked and skipped, or the raw image
+//-----------------------------------------------------------------------------
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "platform.h"
+#include "Turtle.h"
+#include "pff.h"
+#include "bitstream.h"
+
+static struct {
+	uint8	rle;							// reading BIT_RLE_FILE
+	uint32	size;							// uncompressed size
+	uint32	left;							// uncompressed bytes still to come
+	uint8	run;							// bytes left in the current packet
+	uint8	repeat;							// current packet is a repeat
+	uint8	value;							// byte being repeated
+	uint8	inPos;
+	uint8	inLen;
+	uint8	in[RLE_IN_SIZE];
+} sBit;
+
+// BIT_DIR index, built at mount so opening an image doesn't search the
+// directory. The names stay on the card, the entry is read again when needed.
+static struct {
+	uint16	hash;							// of the name, so most are passed over unread
+	uint16	entry;							// directory index, for pf_seekdir()
+} sIndex[BIT_INDEX_SIZE];
+static uint8	sIndexed;					// entries in sIndex[]
+static uint8	sSelected;					// image picked with BitSelect(), 0 for none
+
+static const uint8 sBitMagic[BIT_MAGIC_SIZE] PROGMEM = {
+	0x00, 0x09, 0x0F, 0xF0, 0x0F, 0xF0, 0x0F, 0xF0, 0x0F, 0xF0, 0x00, 0x00, 0x01
+};
+
+//-----------------------------------------------------------------------------
+//	Reads a big endian number n bytes long
+//-----------------------------------------------------------------------------
+static uint8 ReadBE(uint8 n, uint32 *v) {
+
+	uint8 res;
+	uint16 br;
+
+	if (((res = pf_read(sBit.in, n, &br)) != FR_OK) || (br != n))
+		return res ? res : FR_DISK_ERR;
+	for (*v = 0, br = 0; br < n; br++)
+		*v = (*v << 8) | sBit.in[br];
+	return FR_OK;
+}
+
+//-----------------------------------------------------------------------------
+//	Prints the fields of a .bit header, checks the part, and leaves the file
+//	at the start of the data. A file without the header is rewound.
+//-----------------------------------------------------------------------------
+static uint8 BitHeader(void) {
+
+	uint8 res, key;
+	uint16 br;
+	uint32 len;
+
+	if ((res = pf_read(sBit.in, BIT_MAGIC_SIZE, &br)) != FR_OK)
+		return res;
+	if ((br != BIT_MAGIC_SIZE) || memcmp_P(sBit.in, sBitMagic, BIT_MAGIC_SIZE))
+		return pf_lseek(0);
+
+	for (;;) {
+		if ((res = pf_read(&key, 1, &br)) != FR_OK)
+			return res;
+		if (br && (key == 'e'))
+			break;
+		if (!br || (key < 'a') || (key > 'd') || ((res = ReadBE(2, &len)) != FR_OK)) {
+			fputs_P(PSTR("Bad .bit header\r\n"), fio);
+			return res ? res : FR_DISK_ERR;
+		}
+
+		// print what fits in the buffer, seek past the rest
+		if ((res = pf_read(sBit.in, len < RLE_IN_SIZE ? len : RLE_IN_SIZE - 1, &br)) != FR_OK)
+			return res;
+		sBit.in[br] = '\0';
+		if ((res = pf_lseek(gFatFs.fptr + len - br)) != FR_OK)
+			return res;
+
+		switch (key) {
+			case 'a':
+				fprintf_P(fio, PSTR("Design: %s\r\n"), sBit.in);
+				break;
+
+			case 'b':
+				fprintf_P(fio, PSTR("Part:   %s\r\n"), sBit.in);
+				if (strncmp_P((char *)sBit.in, PSTR(BIT_PART), sizeof(BIT_PART) - 1)) {
+					fputs_P(PSTR("Wrong part, expected " BIT_PART "\r\n"), fio);
+					return FR_DISK_ERR;
+				}
+				break;
+
+			case 'c':
+				fprintf_P(fio, PSTR("Date:   %s "), sBit.in);
+				break;
+
+			case 'd':
+				fprintf_P(fio, PSTR("%s\r\n"), sBit.in);
+				break;
+		}
+	}
+
+	if ((res = ReadBE(4, &sBit.size)) != FR_OK)
+		return res;
+	fprintf_P(fio, PSTR("%lu bytes of configuration\r\n"), sBit.size);
+	return FR_OK;
+}
+
+//-----------------------------------------------------------------------------
+//	Hash of an 8.3 name, never 0
+//-----------------------------------------------------------------------------
+static uint16 NameHash(const char *p) {
+
+	uint16 h = 0;
+
+	while (*p)
+		h = (h << 5) - h + toupper(*p++);
+	return h ? h : 1;
+}
+
+//-----------------------------------------------------------------------------
+//	True for files that look like images: .BIN, .BIT or .RLE
+//-----------------------------------------------------------------------------
+static uint8 IsImage(FILINFO *fno) {
+
+	char *ext = strchr(fno->fname, '.');
+
+	if (!fno->fname[0] || (fno->fattrib & (AM_DIR | AM_VOL)) || !ext)
+		return false;
+	return !strcmp_P(ext, PSTR(".BIN")) || !strcmp_P(ext, PSTR(".BIT")) || !strcmp_P(ext, PSTR(".RLE"));
+}
+
+//-----------------------------------------------------------------------------
+//	Reads BIT_DIR into the index, called after each mount
+//-----------------------------------------------------------------------------
+void BitIndex(void) {
+
+	DIR dir;
+	FILINFO fno;
+
+	sIndexed = 0;
+	sSelected = 0;
+	if (pf_opendir_P(&dir, PSTR(BIT_DIR)) != FR_OK)
+		return;
+
+	while ((pf_readdir(&dir, &fno) == FR_OK) && fno.fname[0] && (sIndexed < BIT_INDEX_SIZE)) {
+		if (!IsImage(&fno))
+			continue;
+		sIndex[sIndexed].hash = NameHash(fno.fname);
+		sIndex[sIndexed++].entry = fno.findex;
+	}
+	fprintf_P(fio, PSTR("%d image(s) in " BIT_DIR "\r\n"), sIndexed);
+}
+
+//-----------------------------------------------------------------------------
+//	Reads the directory entry of index entry i. Fails with FR_NO_FILE if it
+//	has changed since the mount.
+//-----------------------------------------------------------------------------
+static uint8 IndexEntry(uint8 i, FILINFO *fno) {
+
+	DIR dir;
+	uint8 res;
+
+	if (((res = pf_opendir_P(&dir, PSTR(BIT_DIR))) != FR_OK) || ((res = pf_seekdir(&dir, sIndex[i].entry)) != FR_OK) ||
+		((res = pf_readdir(&dir, fno)) != FR_OK))
+		return res;
+	return (fno->fname[0] && (NameHash(fno->fname) == sIndex[i].hash)) ? FR_OK : FR_NO_FILE;
+}
+
+//-----------------------------------------------------------------------------
+//	Lists the images in BIT_DIR from the index, numbered as BitSelect() takes
+//	them
+//-----------------------------------------------------------------------------
+void BitList(void) {
+
+	FILINFO fno;
+	uint8 i;
+
+	for (i = 0; i < sIndexed; i++) {
+		if (IndexEntry(i, &fno) != FR_OK)
+			continue;
+		fprintf_P(fio, PSTR("%c%2d  %-12s %9lu\r\n"), (i + 1 == sSelected) ? '*' : ' ', i + 1, fno.fname, fno.fsize);
+	}
+	fputs_P(PSTR("  0  default (fpga.rle, fpga.bit or fpga.bin)\r\n"), fio);
+}
+
+//-----------------------------------------------------------------------------
+//	Picks the image write and verify use, 0 goes back to the default files.
+//	Returns true if there is no such image.
+//-----------------------------------------------------------------------------
+uint8 BitSelect(uint8 n) {
+
+	if (n > sIndexed)
+		return true;
+	sSelected = n;
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+//	Opens a file. A name without a path that isn't in the root is looked
+//	for in the index.
+//-----------------------------------------------------------------------------
+static uint8 OpenFile(const char *name) {
+
+	FILINFO fno;
+	uint8 res, i;
+	uint16 h;
+
+	if (((res = pf_open(name)) != FR_NO_FILE) || strchr(name, '/'))
+		return res;
+	h = NameHash(name);
+	for (i = 0; i < sIndexed; i++) {
+		if (sIndex[i].hash != h)
+			continue;
+		if ((IndexEntry(i, &fno) == FR_OK) && !strcasecmp(fno.fname, name))
+			return pf_openclust(fno.fclust, fno.fsize);
+	}
+	return res;
+}
+
+//-----------------------------------------------------------------------------
+//	Works out the format of the open file and gets it ready for BitRead()
+//-----------------------------------------------------------------------------
+static uint8 BitFormat(void) {
+
+	uint8 res;
+	uint16 n;
+
+	sBit.rle = false;
+	sBit.size = gFatFs.fsize;
+	if ((res = pf_read(sBit.in, 8, &n)) != FR_OK)
+		return res;
+	if ((n == 8) && (LD_DWORD(sBit.in) == RLE_MAGIC)) {
+		sBit.rle = true;
+		sBit.size = sBit.left = LD_DWORD(sBit.in + 4);
+		sBit.run = 0;
+		sBit.inPos = sBit.inLen = 0;
+		fprintf_P(fio, PSTR("Compressed: %lu bytes from %lu\r\n"), sBit.size, gFatFs.fsize);
+		return FR_OK;
+	}
+
+	if ((res = pf_lseek(0)) != FR_OK)
+		return res;
+	return BitHeader();
+}
+
+//-----------------------------------------------------------------------------
+//	Opens the named image, or the one picked with BitSelect(), or failing
+//	that the compressed image if there is one, then the .bit file, then the
+//	raw image. The format comes from the contents, not the name.
+//-----------------------------------------------------------------------------
+uint8 BitOpen(const char *name) {
+
+	FILINFO fno;
+	uint8 res;
+
+	if (name)
+		res = OpenFile(name);
+	else if (sSelected) {
+		if ((res = IndexEntry(sSelected - 1, &fno)) == FR_OK)
+			res = pf_openclust(fno.fclust, fno.fsize);
+	} else if (((res = pf_open_P(PSTR(BIT_RLE_FILE))) != FR_OK) && ((res = pf_open_P(PSTR(BIT_BIT_FILE))) != FR_OK))
+		res = pf_open_P(PSTR(BIT_RAW_FILE));
+	if (res != FR_OK)
+		return res;
+	return BitFormat();
+}
+
+//-----------------------------------------------------------------------------
+//	Opens an image again by its first cluster, as BitOpen() found it
+//-----------------------------------------------------------------------------
+uint8 BitReopen(uint32 clust, uint32 fsize) {
+
+	uint8 res;
+
+	if ((res = pf_openclust(clust, fsize)) != FR_OK)
+		return res;
+	return BitFormat();
+}
+
+//-----------------------------------------------------------------------------
+uint32 BitSize(void) {
+
+	return sBit.size;
+}
+
+//-----------------------------------------------------------------------------
+//	Gets the next byte of the compressed file
+//-----------------------------------------------------------------------------
+static uint8 InByte(uint8 *b) {
+
+	uint8 res;
+	uint16 n;
+
+	if (sBit.inPos == sBit.inLen) {
+		if ((res = pf_read(sBit.in, RLE_IN_SIZE, &n)) != FR_OK)
+			return res;
+		if (!n)
+			return FR_DISK_ERR;								// file is short
+		sBit.inLen = n;
+		sBit.inPos = 0;
+	}
+	*b = sBit.in[sBit.inPos++];
+	return FR_OK;
+}
+
+//-----------------------------------------------------------------------------
+//	Reads the control byte of the next packet, and the byte a repeat repeats
+//-----------------------------------------------------------------------------
+static uint8 NextPacket(void) {
+
+	uint8 c, res;
+
+	if ((res = InByte(&c)) != FR_OK)
+		return res;
+	if (c < 0x80) {
+		sBit.run = c + 1;
+		sBit.repeat = false;
+		return FR_OK;
+	}
+	sBit.run = c - 0x80 + RLE_MIN_RUN;
+	sBit.repeat = true;
+	return InByte(&sBit.value);
+}
+
+//-----------------------------------------------------------------------------
+//	Same as pf_read(), returns the uncompressed image whichever file is open
+//-----------------------------------------------------------------------------
+uint8 BitRead(uint8 *buf, uint16 btr, uint16 *br) {
+
+	uint8 n, res;
+
+	if (!sBit.rle)
+		return pf_read(buf, btr, br);
+
+	*br = 0;
+	if (btr > sBit.left)
+		btr = sBit.left;
+
+	while (*br < btr) {
+		if (!sBit.run && ((res = NextPacket()) != FR_OK))
+			return res;
+
+		if (sBit.repeat) {
+			n = (btr - *br < sBit.run) ? btr - *br : sBit.run;
+			memset(buf + *br, sBit.value, n);
+			*br += n;
+			sBit.run -= n;
+		} else {
+			if ((res = InByte(buf + *br)) != FR_OK)
+				return res;
+			(*br)++;
+			sBit.run--;
+		}
+	}
+	sBit.left -= *br;
+	return FR_OK;
+}
+
+//-----------------------------------------------------------------------------
+//	Passes over *n bytes of the image, leaving in *n what is still to go.
+//	A compressed image is decoded RLE_SKIP_STEP at a time, so it takes
+//	several calls.
+//-----------------------------------------------------------------------------
+uint8 BitSkip(uint32 *n) {
+
+	uint8 c, res;
+	uint16 k;
+
+	if (!sBit.rle) {
+		res = pf_lseek(gFatFs.fptr + *n);
+		*n = 0;
+		return res;
+	}
+
+	if (*n > sBit.left)
+		*n = sBit.left;
+	for (k = 0; *n && (k < RLE_SKIP_STEP); k++) {
+		if (!sBit.run && ((res = NextPacket()) != FR_OK))
+			return res;
+		if (!sBit.repeat && ((res = InByte(&c)) != FR_OK))
+			return res;
+		sBit.run--;
+		sBit.left--;
+		(*n)--;
+	}
+	return FR_OK;
+}
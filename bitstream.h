@@ -0,0 +1,43 @@
+//-----------------------------------------------------------------------------
+//	Turtle Board Atmel Code
+//	bitstream.h
+//-----------------------------------------------------------------------------
+#ifndef BITSTREAM_H_
+#define BITSTREAM_H_
+
+#include "platform.h"
+
+uint8	BitOpen(const char *name);
+uint8	BitReopen(uint32 clust, uint32 fsize);
+uint8	BitRead(uint8 *buf, uint16 btr, uint16 *br);
+uint8	BitSkip(uint32 *n);
+uint32	BitSize(void);
+void	BitIndex(void);
+void	BitList(void);
+uint8	BitSelect(uint8 n);
+
+#define BIT_RAW_FILE		"/fpga.bin"
+#define BIT_BIT_FILE		"/fpga.bit"		// synthesis output, header and all
+#define BIT_RLE_FILE		"/fpga.rle"		// used in preference to the others
+#define BIT_PART			"6slx25"		// part in the .bit header must start with this
+#define BIT_DIR				"/FPGA"			// images that can be picked by number
+#define BIT_INDEX_SIZE		16				// images in BIT_DIR indexed at mount
+
+// Xilinx .bit header: 00 09, 0F F0 0F F0 0F F0 0F F0 00, 00 01, then fields of
+// a key letter and a 2 byte big endian length: 'a' design, 'b' part, 'c' date,
+// 'd' time. Last comes 'e' with a 4 byte big endian length and the data.
+#define BIT_MAGIC_SIZE		13
+
+// Compressed image, made by tools/rlepack.c:
+//	"TRLE", uncompressed length (4 bytes, little endian), then packets of a
+//	control byte c followed by
+//		c < 0x80	c + 1 literal bytes
+//		c >= 0x80	one byte, repeated c - 0x80 + RLE_MIN_RUN times
+#define RLE_MAGIC			0x454C5254ul	// "TRLE" read little endian
+#define RLE_MIN_RUN			3
+#define RLE_MAX_RUN			(0x7F + RLE_MIN_RUN)
+#define RLE_MAX_LITERAL		0x80
+#define RLE_IN_SIZE			32				// compressed input buffer
+#define RLE_SKIP_STEP		2048			// most BitSkip() decodes in a call
+
+#endif
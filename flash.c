@@ -7,9 +7,11 @@
 //-----------------------------------------------------------------------------
 #include <avr/interrupt.h>
 #include <avr/io.h>
+#include <avr/eeprom.h>
 
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <ctype.h>
@@ -19,6 +21,42 @@
 #include "serialio.h"
 #include "Turtle.h"
 #include "pff.h"
+#include "sd.h"
+#include "job.h"
+#include "bitstream.h"
+#include "stats.h"
+#include "slot.h"
+#include "spi.h"
+#include <util/crc16.h>
+#include <util/delay.h>
+
+static uint8	sBuffer[FLASH_PAGE_SIZE];		// of the running job
+static struct {
+	uint32	addr;								// next flash address
+	uint32	start;
+	uint32	end;
+	uint32	errors;
+	uint32	skipped;							// blank pages not programmed
+	uint32	limit;								// end of the area being written
+	uint16	started;							// Clock() at the start of the job
+	uint16	crc;								// of the image written
+	uint16	want;								// CRC the check expects
+	uint16	eraseStarted;
+	uint16	eraseTicks;							// spent waiting for erases
+	uint16	sectorCrc;							// of the sector being written
+	uint32	skip;								// image bytes to pass over when resuming
+	uint8	session;							// of the checkpoints
+	uint8	erase;								// erase ahead of the write
+	uint8	compare;							// check the CRC against want
+	uint8	erasing;
+	copy_done_t	done;							// called when a write finishes
+} sJob;
+static uint8	sEraseSuspended;				// an aborted erase is suspended
+
+FLASH_INFO		gFlash;
+
+static CKPT_HDR EEMEM	eCkptHdr;
+static CKPT_REC EEMEM	eCkpt[CKPT_RING];
 
 //-----------------------------------------------------------------------------
 uint8 SpiTransferByte(uint8 send) {
@@ -43,20 +81,79 @@ static uint8 ReadFlashStatus(void) {
 //-----------------------------------------------------------------------------
 static void WaitForReady(void) {
 
-	FLASH_SEL;
+	SpiBegin(SPI_FLASH, SPI_FAST);
 	while (ReadFlashStatus() & 0x01);
-	FLASH_DESEL;
+	SpiEnd(SPI_FLASH);
+}
+
+//-----------------------------------------------------------------------------
+//	Reads the WIP bit without waiting
+//-----------------------------------------------------------------------------
+static uint8 FlashBusy(void) {
+
+	uint8 status;
+
+	SpiBegin(SPI_FLASH, SPI_FAST);
+	status = ReadFlashStatus();
+	SpiEnd(SPI_FLASH);
+
+	return status & 0x01;
+}
+
+//-----------------------------------------------------------------------------
+//	Sends the resume for an erase suspended by an abort. The resumed erase
+//	runs on, the caller waits for WIP to clear before using the flash.
+//-----------------------------------------------------------------------------
+static void ResumeErase(void) {
+
+	if (!sEraseSuspended)
+		return;
+
+	SpiBegin(SPI_FLASH, SPI_FAST);
+	SpiTransferByte(gFlash.resumeOp);
+	SpiEnd(SPI_FLASH);
+	sEraseSuspended = false;
+}
+
+//-----------------------------------------------------------------------------
+//	Resumes a suspended erase and waits for it to finish, so nothing reads,
+//	writes or boots from a half erased block
+//-----------------------------------------------------------------------------
+static void FinishErase(void) {
+
+	if (!sEraseSuspended)
+		return;
+	ResumeErase();
+	while (FlashBusy())
+		HandleUsb();
 }
 
 //-----------------------------------------------------------------------------
 static void WriteEnable(uint8 we) {
 
-	FLASH_SEL;
+	SpiBegin(SPI_FLASH, SPI_FAST);
 	if (we)
 		SpiTransferByte(WRITE_ENABLE);
 	else
 		SpiTransferByte(WRITE_DISABLE);
-	FLASH_DESEL;
+	SpiEnd(SPI_FLASH);
+}
+
+//-----------------------------------------------------------------------------
+//	Selects the flash and sends a command with 3 or 4 address bytes, the
+//	caller sends or reads the data and deselects. A suspended erase is
+//	finished first.
+//-----------------------------------------------------------------------------
+static void FlashCommand(uint8 op, uint32 addr) {
+
+	FinishErase();
+	SpiBegin(SPI_FLASH, SPI_FAST);
+	SpiTransferByte(op);
+	if (gFlash.addrBytes == 4)
+		SpiTransferByte(addr >> 24);
+	SpiTransferByte(addr >> 16);
+	SpiTransferByte(addr >> 8);
+	SpiTransferByte(addr);
 }
 
 //-----------------------------------------------------------------------------
@@ -74,22 +171,14 @@ void WriteFlash(uint8 mode, uint32 address, uint8 data) {
 		writing = false;
 
 		WriteEnable(true);									// start writing next page
-		FLASH_SEL;
-		SpiTransferByte(PAGE_PROGRAM);
-		SpiTransferByte(addr >> 16);
-		SpiTransferByte(addr >> 8);
-		SpiTransferByte(addr);
+		FlashCommand(gFlash.programOp, addr);
 	}
 	
 	switch (mode) {
 		case FLASH_START: 
 			addr = address;
 			WriteEnable(true);
-			FLASH_SEL;
-			SpiTransferByte(PAGE_PROGRAM);
-			SpiTransferByte(addr >> 16);
-			SpiTransferByte(addr >> 8);
-			SpiTransferByte(addr);
+			FlashCommand(gFlash.programOp, addr);
 			break;
 
 		case FLASH_CONT:
@@ -98,13 +187,13 @@ void WriteFlash(uint8 mode, uint32 address, uint8 data) {
 
 			// check if next write will cross a page boundary
 			if ((addr & 0x000000FF) == 0l)	{
-				FLASH_DESEL;								// write the page - takes 5ms
+				SpiEnd(SPI_FLASH);								// write the page - takes 5ms
 				writing = true;
 			}	
 			break;
 
 		case FLASH_END:
-			FLASH_DESEL;									// write the page
+			SpiEnd(SPI_FLASH);									// write the page
 			WaitForReady();									// and wait
 			break;
 
@@ -114,53 +203,512 @@ void WriteFlash(uint8 mode, uint32 address, uint8 data) {
 }
 
 //-----------------------------------------------------------------------------
-uint8 CfgCopy(void) {
+//	Returns true every ERASE_POLL timer counts, so the status register is
+//	polled at a fixed rate however fast the main loop goes round
+//-----------------------------------------------------------------------------
+static uint8 ErasePollDue(void) {
 
-	uint8 buffer[FLASH_PAGE_SIZE], res, done;
-	uint16 bytesRead;
-	uint32 bytesWritten, addr;
-
-	fputs_P(PSTR("Writing configuration:\r\n"), fio);
-	if ((res = pf_open("/fpga.bin")) != FR_OK) {
-		fprintf_P(fio, PSTR("res = %d\r"), res);
-		HandleUsb();
-		goto failed;
-	}
-	
-	addr = 0;
-	bytesWritten = 0;
-	for (addr = 0, done = false; !done; addr += FLASH_PAGE_SIZE) {
-		// read page from file
-		res = pf_read(buffer, FLASH_PAGE_SIZE * sizeof(uint8), &bytesRead);
-		if ((bytesRead != FLASH_PAGE_SIZE * sizeof(int8)) || res)			// end of file or error
-			done = true;
+	static uint16 last;
+	uint16 now = TCNT1;
+
+	if ((uint16)(now + (OCR1A + 1) - last) % (OCR1A + 1) < ERASE_POLL)
+		return false;
+	last = now;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+//	Picks the biggest erase that is aligned at addr and doesn't go past end,
+//	the smallest is used when nothing else fits
+//-----------------------------------------------------------------------------
+static uint8 EraseType(uint32 addr, uint32 end) {
+
+	uint8 t;
+	uint32 size;
+
+	for (t = 0; t < gFlash.eraseTypes - 1; t++) {
+		size = 1ul << gFlash.erase[t].shift;
+		if (!(addr & (size - 1)) && (addr + size <= end))
+			break;
+	}
+	return t;
+}
+
+//-----------------------------------------------------------------------------
+//	Returns true if all n bytes are 0xFF, the erased value
+//-----------------------------------------------------------------------------
+static uint8 Blank(const uint8 *p, uint16 n) {
 
-		// now write page to flash
-		WaitForReady();										// wait for last write to complete
+	while (n--)
+		if (*p++ != 0xFF)
+			return false;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+//	True, and an error, if the supply is failing, so nothing is written
+//-----------------------------------------------------------------------------
+static uint8 PowerFail(void) {
+
+	if (!gPowFail && !gPowSag)
+		return false;
+	if (!JobBusy())
+		gPowSag = false;										// refusing to start is acting on it
+	fputs_P(PSTR("Supply failing, not writing\r\n"), fio);
+	gFlags.error = true;
+	return true;
+}
 
+//-----------------------------------------------------------------------------
+//	Records that the write has got to sJob.addr, once the last page is in
+//-----------------------------------------------------------------------------
+static void Checkpoint(void) {
+
+	CKPT_REC rec;
+	CKPT_REC *p = &eCkpt[(sJob.addr >> FLASH_SECTOR_SHIFT) % CKPT_RING];
+
+	WaitForReady();
+	rec.addr = sJob.addr;
+	rec.crc = sJob.crc;
+	rec.sectorCrc = sJob.sectorCrc;
+	rec.spare = 0;
+	eeprom_update_block(&rec, p, offsetof(CKPT_REC, session));
+	eeprom_update_byte(&p->session, sJob.session);
+	sJob.sectorCrc = 0;
+}
+
+//-----------------------------------------------------------------------------
+//	Writes one page per step. The page write carries on while the next page
+//	is read from the SD card. Pages that are all 0xFF are already there
+//	after an erase, so they are skipped. With erase set each block is
+//	erased when the write reaches it, and only as far as the image goes.
+//-----------------------------------------------------------------------------
+static uint8 CfgCopyStep(uint8 cmd) {
+
+	uint8 res, t;
+	uint16 bytesRead, i, n;
+
+	switch (cmd) {
+		case JOB_STATUS:
+			fprintf_P(fio, PSTR("Writing: %ld kb, %lu blank pages skipped\r\n"), sJob.addr >> 10, sJob.skipped);
+			return JOB_BUSY;
+
+		case JOB_POWFAIL:
+		case JOB_ABORT:
+			WaitForReady();
+			StatWritten(sJob.addr - sJob.start, sJob.eraseTicks);
+			if (cmd == JOB_POWFAIL) {
+				eeprom_update_byte(&eCkptHdr.suspect, true);
+				fputs_P(PSTR("supply failing, "), fio);
+			}
+			fputs_P(PSTR("aborted \r\n"), fio);
+			return JOB_FAILED;
+	}
+
+	if (sJob.erasing) {
+		if (!ErasePollDue() || FlashBusy())
+			return JOB_BUSY;
+		sJob.erasing = false;
+		sJob.eraseTicks += Clock() - sJob.eraseStarted;
+	}
+	if (sJob.skip) {											// resuming
+		if ((res = BitSkip(&sJob.skip)) != FR_OK) {
+			fputs_P(PSTR("failed \r\n"), fio);
+			return JOB_FAILED;
+		}
+		return JOB_BUSY;
+	}
+	if (sJob.erase && (sJob.addr >= sJob.end) && (sJob.addr < sJob.start + BitSize())) {
+		t = EraseType(sJob.addr, sJob.limit);
+		WaitForReady();										// last page write
 		WriteEnable(true);
-		FLASH_SEL;
-		SpiTransferByte(PAGE_PROGRAM);
-		SpiTransferByte(addr >> 16);
-		SpiTransferByte(addr >> 8);
-		SpiTransferByte(addr);
-
-		for (uint16 i = 0; i < bytesRead; i++)
-			SpiTransferByte(buffer[i]);
-		FLASH_DESEL;										// write the page - takes 5ms
-
-		bytesWritten += bytesRead;
-		if (!(bytesWritten % 10240))
-			fprintf_P(fio, PSTR("%ld kb\r"), bytesWritten / 1024);
-		HandleUsb();
-	}
-	
-failed:
-	if (res)
+		FlashCommand(gFlash.erase[t].op, sJob.addr);
+		SpiEnd(SPI_FLASH);
+		sJob.end = sJob.addr + (1ul << gFlash.erase[t].shift);
+		sJob.erasing = true;
+		sJob.eraseStarted = Clock();
+		return JOB_BUSY;
+	}
+
+	// read page from file
+	res = BitRead(sBuffer, FLASH_PAGE_SIZE * sizeof(uint8), &bytesRead);
+	for (i = 0; i < bytesRead; i++) {
+		sJob.crc = _crc_xmodem_update(sJob.crc, sBuffer[i]);
+		sJob.sectorCrc = _crc_xmodem_update(sJob.sectorCrc, sBuffer[i]);
+	}
+
+	// now write page to flash, in smaller pieces if the part has small pages
+	for (i = 0; i < bytesRead; i += n) {
+		n = gFlash.pageSize - (sJob.addr & (gFlash.pageSize - 1));
+		if (n > bytesRead - i)
+			n = bytesRead - i;
+
+		if (Blank(sBuffer + i, n))
+			sJob.skipped++;
+		else {
+			WaitForReady();									// wait for last write to complete
+
+			WriteEnable(true);
+			FlashCommand(gFlash.programOp, sJob.addr);
+			for (uint16 j = i; j < i + n; j++)
+				SpiTransferByte(sBuffer[j]);
+			SpiEnd(SPI_FLASH);									// write the page - takes 5ms
+		}
+		sJob.addr += n;
+	}
+	if (bytesRead) {
+		if (!(sJob.addr % 10240))
+			fprintf_P(fio, PSTR("%ld kb\r"), sJob.addr / 1024);
+		if (!(sJob.addr & (CKPT_SIZE - 1)))
+			Checkpoint();
+	}
+
+	if ((bytesRead == FLASH_PAGE_SIZE * sizeof(uint8)) && !res)
+		return JOB_BUSY;
+
+	// end of file or error
+	WaitForReady();
+	StatWritten(sJob.addr - sJob.start, sJob.eraseTicks);
+	if (res) {
 		fputs_P(PSTR("failed \r\n"), fio);
-	else
-		fputs_P(PSTR("complete\r\n"), fio);
-	return res;
+		return JOB_FAILED;
+	}
+	fprintf_P(fio, PSTR("complete, %lu blank pages skipped, CRC %04X\r\n"), sJob.skipped, sJob.crc);
+	if (sJob.done)
+		sJob.done(sJob.addr - sJob.start, sJob.crc);
+	eeprom_update_byte(&eCkptHdr.active, false);
+	return JOB_DONE;
+}
+
+//-----------------------------------------------------------------------------
+//	Starts a job writing the named image (the default with no name) from
+//	base up to limit, returns the file open result. done is called with the
+//	size and CRC when the write has worked.
+//-----------------------------------------------------------------------------
+uint8 CfgCopy(const char *name, uint32 base, uint32 limit, uint8 erase, copy_done_t done) {
+
+	CKPT_HDR *hdr = (CKPT_HDR *)sBuffer;					// free until the first step
+	uint8 res;
+
+	fputs_P(PSTR("Writing configuration:\r\n"), fio);
+	if (PowerFail())
+		return FR_DISK_ERR;
+	ResumeErase();
+	if ((res = BitOpen(name)) != FR_OK) {
+		fprintf_P(fio, PSTR("res = %d\r"), res);
+		fputs_P(PSTR("failed \r\n"), fio);
+		return res;
+	}
+	if (BitSize() > limit - base) {
+		fprintf_P(fio, PSTR("%lu kb image won't fit in %lu kb\r\n"), BitSize() >> 10, (limit - base) >> 10);
+		return FR_DISK_ERR;
+	}
+
+	sJob.start = sJob.end = sJob.addr = base;
+	sJob.limit = limit;
+	sJob.skipped = 0;
+	sJob.crc = 0;
+	sJob.erase = erase;
+	sJob.erasing = false;
+	sJob.eraseTicks = 0;
+	sJob.done = done;
+	sJob.sectorCrc = 0;
+	sJob.skip = 0;
+	JobStart(CfgCopyStep);
+	StatBegin(base);
+
+	// a new session, whose checkpoints replace the last one's. Any left from
+	// the last time round of the session number are marked old.
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->session = sJob.session = eeprom_read_byte(&eCkptHdr.session) + 1;
+	for (uint8 i = 0; i < CKPT_RING; i++)
+		if (eeprom_read_byte(&eCkpt[i].session) == hdr->session)
+			eeprom_update_byte(&eCkpt[i].session, hdr->session - 1);
+	hdr->erase = erase;
+	hdr->base = base;
+	hdr->limit = limit;
+	hdr->size = BitSize();
+	hdr->fsize = gFatFs.fsize;
+	hdr->clust = gFatFs.org_clust;
+	if (name)
+		strncpy(hdr->name, name, sizeof(hdr->name) - 1);
+	eeprom_update_block(hdr, &eCkptHdr, sizeof(*hdr));
+	eeprom_update_byte(&eCkptHdr.active, true);
+	return FR_OK;
+}
+
+//-----------------------------------------------------------------------------
+//	Finds the checkpoint of the session at addr, or the newest if addr is
+//	CKPT_NEWEST. Returns false if there isn't one.
+//-----------------------------------------------------------------------------
+static uint8 FindCheckpoint(uint8 session, uint32 addr, CKPT_REC *rec) {
+
+	CKPT_REC r;
+	uint8 found = false;
+
+	for (uint8 i = 0; i < CKPT_RING; i++) {
+		eeprom_read_block(&r, &eCkpt[i], sizeof(r));
+		if ((r.session != session) || ((addr != CKPT_NEWEST) && (r.addr != addr)) || (found && (r.addr < rec->addr)))
+			continue;
+		*rec = r;
+		found = true;
+	}
+	return found;
+}
+
+//-----------------------------------------------------------------------------
+//	CRC of a sector as it reads back
+//-----------------------------------------------------------------------------
+static uint16 SectorCrc(uint32 addr) {
+
+	uint16 crc = 0;
+
+	ReadFlash(FLASH_START, addr);
+	for (uint32 i = 0; i < CKPT_SIZE; i++)
+		crc = _crc_xmodem_update(crc, ReadFlash(FLASH_CONT, 0));
+	ReadFlash(FLASH_END, 0);
+	return crc;
+}
+
+//-----------------------------------------------------------------------------
+//	Moves rec back a sector, to the start of the write if that's where it
+//	gets to or there's no checkpoint for it
+//-----------------------------------------------------------------------------
+static void StepBack(const CKPT_HDR *hdr, CKPT_REC *rec) {
+
+	if ((rec->addr - hdr->base <= CKPT_SIZE) || !FindCheckpoint(hdr->session, rec->addr - CKPT_SIZE, rec))
+		rec->addr = hdr->base;
+}
+
+//-----------------------------------------------------------------------------
+//	Called by a resumed write when the image is in
+//-----------------------------------------------------------------------------
+static void Resumed(uint32 size, uint16 crc) {
+
+	CKPT_HDR *hdr = (CKPT_HDR *)sBuffer;					// the write is done with it
+
+	eeprom_read_block(hdr, &eCkptHdr, sizeof(*hdr));
+	SlotResumed(hdr->base, size, crc, hdr->name);
+}
+
+//-----------------------------------------------------------------------------
+//	Carries on with an interrupted write from its last checkpoint, once the
+//	sector below it reads back right. Returns true if there is nothing to
+//	resume or the image has gone.
+//-----------------------------------------------------------------------------
+uint8 CfgResume(void) {
+
+	CKPT_HDR *hdr = (CKPT_HDR *)sBuffer;					// free until the first step
+	CKPT_REC rec;
+
+	eeprom_read_block(hdr, &eCkptHdr, sizeof(*hdr));
+	if (hdr->active != true) {
+		fputs_P(PSTR("Nothing to resume\r\n"), fio);
+		return true;
+	}
+	fputs_P(PSTR("Resuming configuration write:\r\n"), fio);
+	if (PowerFail())
+		return true;
+	ResumeErase();
+
+	// step back to a sector that checks, and one more if the supply was
+	// failing when the write stopped
+	if (!FindCheckpoint(hdr->session, CKPT_NEWEST, &rec) || (rec.addr < hdr->base))
+		rec.addr = hdr->base;
+	if (hdr->suspect && (rec.addr > hdr->base))
+		StepBack(hdr, &rec);
+	eeprom_update_byte(&eCkptHdr.suspect, false);
+	while (rec.addr > hdr->base) {
+		HandleUsb();
+		if (SectorCrc(rec.addr - CKPT_SIZE) == rec.sectorCrc)
+			break;
+		fprintf_P(fio, PSTR("%lu kb doesn't check\r\n"), (rec.addr - CKPT_SIZE) >> 10);
+		StepBack(hdr, &rec);
+	}
+	if (rec.addr == hdr->base)
+		rec.crc = 0;
+	fprintf_P(fio, PSTR("from %lu kb\r\n"), (rec.addr - hdr->base) >> 10);
+	if ((BitReopen(hdr->clust, hdr->fsize) != FR_OK) || (BitSize() != hdr->size)) {
+		fputs_P(PSTR("The image has changed, write it again\r\n"), fio);
+		return true;
+	}
+
+	sJob.start = hdr->base;
+	sJob.end = sJob.addr = rec.addr;
+	sJob.limit = hdr->limit;
+	sJob.skip = rec.addr - hdr->base;
+	sJob.skipped = 0;
+	sJob.crc = rec.crc;
+	sJob.sectorCrc = 0;
+	sJob.erase = hdr->erase;
+	sJob.erasing = false;
+	sJob.eraseTicks = 0;
+	sJob.session = hdr->session;
+	sJob.done = Resumed;
+	JobStart(CfgCopyStep);
+	StatBegin(hdr->base);
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+//	Ticks the last write spent waiting for erases
+//-----------------------------------------------------------------------------
+uint16 CfgEraseTicks(void) {
+
+	return sJob.eraseTicks;
+}
+
+//-----------------------------------------------------------------------------
+//	Reads back a page per step for the CRC
+//-----------------------------------------------------------------------------
+static uint8 CfgCheckStep(uint8 cmd) {
+
+	uint16 j, n;
+
+	switch (cmd) {
+		case JOB_STATUS:
+			fprintf_P(fio, PSTR("Checking: %ld kb\r\n"), (sJob.addr - sJob.start) >> 10);
+			return JOB_BUSY;
+
+		case JOB_ABORT:
+			fputs_P(PSTR("aborted \r\n"), fio);
+			return JOB_FAILED;
+	}
+
+	n = (sJob.end - sJob.addr < FLASH_PAGE_SIZE) ? sJob.end - sJob.addr : FLASH_PAGE_SIZE;
+	ReadFlash(FLASH_START, sJob.addr);
+	for (j = 0; j < n; j++)
+		sJob.crc = _crc_xmodem_update(sJob.crc, ReadFlash(FLASH_CONT, 0));
+	ReadFlash(FLASH_END, 0);
+	sJob.addr += n;
+
+	if (sJob.addr < sJob.end)
+		return JOB_BUSY;
+
+	if (!sJob.compare) {
+		fprintf_P(fio, PSTR("CRC %04X\r\n"), sJob.crc);
+		return JOB_DONE;
+	}
+	StatChecked(sJob.crc != sJob.want);
+	if (sJob.crc != sJob.want) {
+		fprintf_P(fio, PSTR("CRC %04X, expected %04X, failed\r\n"), sJob.crc, sJob.want);
+		return JOB_FAILED;
+	}
+	fputs_P(PSTR("CRC passed\r\n"), fio);
+	if (sJob.done)
+		sJob.done(sJob.end - sJob.start, sJob.crc);
+	return JOB_DONE;
+}
+
+//-----------------------------------------------------------------------------
+//	Starts a job checking the CRC of base to base + size. Called from the
+//	done function of a write, it runs when the write job finishes.
+//-----------------------------------------------------------------------------
+void CfgCheck(uint32 base, uint32 size, uint16 crc, copy_done_t done) {
+
+	fputs_P(PSTR("Checking CRC:\r\n"), fio);
+	sJob.start = sJob.addr = base;
+	sJob.end = base + size;
+	sJob.want = crc;
+	sJob.compare = true;
+	sJob.crc = 0;
+	sJob.done = done;
+	StatCheckStart(base);
+	if (!JobStart(CfgCheckStep))
+		JobThen(CfgCheckStep);
+}
+
+//-----------------------------------------------------------------------------
+//	Starts a job printing the CRC of base to base + size
+//-----------------------------------------------------------------------------
+void CfgHash(uint32 base, uint32 size) {
+
+	if (base > gFlash.capacity)
+		base = gFlash.capacity;
+	if (size > gFlash.capacity - base)
+		size = gFlash.capacity - base;
+	sJob.start = sJob.addr = base;
+	sJob.end = base + size;
+	sJob.compare = false;
+	sJob.crc = 0;
+	JobStart(CfgCheckStep);
+}
+
+//-----------------------------------------------------------------------------
+//	Ends the dump with a count of 0 and the CRC, or DUMP_ABORTED alone, and
+//	lets console text through again
+//-----------------------------------------------------------------------------
+static uint8 DumpEnd(uint8 done) {
+
+	uint8 tail[4];
+
+	tail[0] = tail[1] = done ? 0 : msb(DUMP_ABORTED);
+	tail[2] = msb(sJob.crc);
+	tail[3] = lsb(sJob.crc);
+	if (!USBwrite(tail, done ? 4 : 2))
+		done = false;
+	CDC_Device_Flush(&VirtualSerial_CDC_Interface);
+	ConsoleMute(false);
+
+	return done ? JOB_DONE : JOB_FAILED;
+}
+
+//-----------------------------------------------------------------------------
+//	Sends a page to the host per step, as a two byte count, high byte first,
+//	and the raw bytes. Console text is muted until the end, so status is
+//	ignored, and an abort is sent as the count DUMP_ABORTED.
+//-----------------------------------------------------------------------------
+static uint8 CfgDumpStep(uint8 cmd) {
+
+	uint16 j, n;
+	uint8 count[2];
+
+	switch (cmd) {
+		case JOB_STATUS:
+			return JOB_BUSY;
+
+		case JOB_ABORT:
+			return DumpEnd(false);
+	}
+
+	if (sJob.addr >= sJob.end)
+		return DumpEnd(true);
+
+	n = (sJob.end - sJob.addr < FLASH_PAGE_SIZE) ? sJob.end - sJob.addr : FLASH_PAGE_SIZE;
+	FlashCommand(gFlash.readOp, sJob.addr);						// one read for the page
+	for (j = 0; j < n; j++)
+		sBuffer[j] = SpiTransferByte(0);
+	SpiEnd(SPI_FLASH);
+	for (j = 0; j < n; j++)
+		sJob.crc = _crc_xmodem_update(sJob.crc, sBuffer[j]);
+	sJob.addr += n;
+
+	count[0] = msb(n);
+	count[1] = lsb(n);
+	if (!USBwrite(count, 2) || !USBwrite(sBuffer, n)) {
+		ConsoleMute(false);
+		return JOB_FAILED;
+	}
+
+	return JOB_BUSY;
+}
+
+//-----------------------------------------------------------------------------
+//	Starts a job sending base to base + size to the host, after a line
+//	giving the address and length
+//-----------------------------------------------------------------------------
+void CfgDump(uint32 base, uint32 size) {
+
+	if (base > gFlash.capacity)
+		base = gFlash.capacity;
+	if (size > gFlash.capacity - base)
+		size = gFlash.capacity - base;
+	fprintf_P(fio, PSTR("\r\nDump %08lX %08lX\r\n"), base, size);
+	sJob.start = sJob.addr = base;
+	sJob.end = base + size;
+	sJob.crc = 0;
+	if (JobStart(CfgDumpStep))
+		ConsoleMute(true);
 }
 
 //-----------------------------------------------------------------------------
@@ -172,14 +720,12 @@ uint8 ReadFlash(uint8 mode, uint32 address) {
 
 	uint8 data;
 	
+	if (mode == FLASH_START)
+		FinishErase();										// before interrupts go off
 	cli();
 	switch (mode) {
 		case FLASH_START:
-			FLASH_SEL;
-			SpiTransferByte(READ_DATA);
-			SpiTransferByte(address >> 16);
-			SpiTransferByte(address >> 8);
-			SpiTransferByte(address);
+			FlashCommand(gFlash.readOp, address);
 			data = 0;
 			break;
 
@@ -189,7 +735,7 @@ uint8 ReadFlash(uint8 mode, uint32 address) {
 
 		case FLASH_END:
 			data = SpiTransferByte(0);
-			FLASH_DESEL;
+			SpiEnd(SPI_FLASH);
 		break;
 
 		default:
@@ -201,184 +747,575 @@ uint8 ReadFlash(uint8 mode, uint32 address) {
 }
 
 //-----------------------------------------------------------------------------
-void CfgVerify(void) {
-
-	uint8 b, buffer[FLASH_PAGE_SIZE], done, res;
-	uint16 j, bytesRead;
-	uint32 addr, errors;
-	
-	fputs_P(PSTR("Verifying configuration:\r\n"), fio);
-	if ((res = pf_open("/fpga.bin")) != FR_OK) {
-		fputs_P(PSTR("Failed to read SD card\r\n"), fio);
-		return;
+//	Verifies one page per step
+//-----------------------------------------------------------------------------
+static uint8 CfgVerifyStep(uint8 cmd) {
+
+	uint8 b, res;
+	uint16 j, bytesRead;
+
+	switch (cmd) {
+		case JOB_STATUS:
+			fprintf_P(fio, PSTR("Verifying: %ld kb, %lu errors\r\n"), sJob.addr >> 10, sJob.errors);
+			return JOB_BUSY;
+
+		case JOB_ABORT:
+			fputs_P(PSTR("aborted \r\n"), fio);
+			return JOB_FAILED;
 	}
 
-	for (addr = 0, done = false, errors = 0; !done; addr += FLASH_PAGE_SIZE) {
-		if (!(addr % 10240)) {
-			fprintf_P(fio, PSTR("%ld kb\r"), addr >> 10);
-			HandleUsb();
-		}
-
-		// read page from file
-		res = pf_read(buffer, FLASH_PAGE_SIZE * sizeof(uint8), &bytesRead);
-		if ((bytesRead != FLASH_PAGE_SIZE * sizeof(int8)) || res)			// end of file or error
-			done = true;
-
-		SD_DESEL;
-
-		// read from flash and compare with buffer[]
-		ReadFlash(FLASH_START, addr);
-		for (j = 0; j < bytesRead; j++) {
-			b = ReadFlash(FLASH_CONT, 0);
-			if (b != buffer[j]) {
-				if (++errors < 30) {
-					EmptyTxBuf();
-					fprintf_P(fio, PSTR("%08lX: SD=%02X cfg=%02X\r\n"), addr + j, buffer[j], b);
-				}
+	if (!(sJob.addr % 10240))
+		fprintf_P(fio, PSTR("%ld kb\r"), sJob.addr >> 10);
+
+	// read page from file
+	res = BitRead(sBuffer, FLASH_PAGE_SIZE * sizeof(uint8), &bytesRead);
+
+	// read from flash and compare with sBuffer[]
+	ReadFlash(FLASH_START, sJob.addr);
+	for (j = 0; j < bytesRead; j++) {
+		b = ReadFlash(FLASH_CONT, 0);
+		if (b != sBuffer[j]) {
+			if (++sJob.errors < 30) {
+				EmptyTxBuf();
+				fprintf_P(fio, PSTR("%08lX: SD=%02X cfg=%02X\r\n"), sJob.addr + j, sBuffer[j], b);
 			}
 		}
-		ReadFlash(FLASH_END, 0);
 	}
-	
-	if (errors)
-		fprintf_P(fio, PSTR("failed with %u errors\r\n"), errors);
-	else
-		fputs_P(PSTR("passed \r\n"), fio);
+	ReadFlash(FLASH_END, 0);
+	sJob.addr += bytesRead;
+
+	if ((bytesRead == FLASH_PAGE_SIZE * sizeof(uint8)) && !res)
+		return JOB_BUSY;
+
+	// end of file or error
+	StatChecked(res ? 1 : sJob.errors);
+	if (res) {
+		fputs_P(PSTR("Failed to read SD card\r\n"), fio);
+		return JOB_FAILED;
+	}
+	if (sJob.errors) {
+		fprintf_P(fio, PSTR("failed with %lu errors\r\n"), sJob.errors);
+		return JOB_FAILED;
+	}
+	fputs_P(PSTR("passed \r\n"), fio);
+	return JOB_DONE;
 }
 
 //-----------------------------------------------------------------------------
-void CheckBlank(void) {
-
-	uint8 b, failed, aborted, errors;
-	uint16 j;
-	uint32 addr;
-	
-	fputs_P(PSTR("Blank check, press any key to abort:\r\n"), fio);
-	for (addr = 0, aborted = failed = false, errors = 0; addr <= MAX_FLASH && !failed; addr += FLASH_PAGE_SIZE) {
-		if (!(addr % 10240)) {
-			fprintf_P(fio, PSTR("%ld kb\r"), addr >> 10);
-			HandleUsb();
-		}
-
-		// read flash a page at a time, otherwise it's really slow
-		ReadFlash(FLASH_START, addr);
-		for (j = 0; j < FLASH_PAGE_SIZE; j++) {
-			b = ReadFlash(FLASH_CONT, 0);
-			if (b != 0xFF) {
-				failed = true;
-				if (++errors < 30) {
-					EmptyTxBuf();
-					fprintf_P(fio, PSTR("%08lX: %02X\r\n"), addr, b);
-				}
-			}
-		}
-		ReadFlash(FLASH_END, 0);
+//	Starts the verify job, returns true if the file can't be opened
+//-----------------------------------------------------------------------------
+uint8 CfgVerify(void) {
 
-		if (CDC_Device_ReceiveByte(&VirtualSerial_CDC_Interface) >= 0) {	// get character if there is one
-			aborted = true;
-			break;
-		}
+	fputs_P(PSTR("Verifying configuration:\r\n"), fio);
+	if (BitOpen(0) != FR_OK) {
+		fputs_P(PSTR("Failed to read SD card\r\n"), fio);
+		return true;
 	}
-	
-	if (failed)
-		fputs_P(PSTR("failed \r\n"), fio);
-	else if (aborted)
-		fputs_P(PSTR("aborted \r\n"), fio);
-	else
-		fputs_P(PSTR("passed \r\n"), fio);
+
+	sJob.addr = 0;
+	sJob.errors = 0;
+	StatCheckStart(0);
+	JobStart(CfgVerifyStep);
+	return false;
 }
 
 //-----------------------------------------------------------------------------
-void ExtReadFlash(void) {
-	
+//	Checks one page per step, stops at the first page that isn't blank
+//-----------------------------------------------------------------------------
+static uint8 CheckBlankStep(uint8 cmd) {
+
 	uint8 b;
-	uint8 j;
-	char string[19];
-	uint32 addr;
-	
-	// read page number (single digit only)
-	USBgetch(string);
-	addr = (uint32)(*string - '0') << 8;
+	uint16 j;
 
-	string[16] = '\r';
-	string[17] = '\n';
-	string[18] = '\0';
+	switch (cmd) {
+		case JOB_STATUS:
+			fprintf_P(fio, PSTR("Blank check: %ld kb\r\n"), sJob.addr >> 10);
+			return JOB_BUSY;
 
-	ReadFlash(FLASH_START, addr);
-	
-	fprintf_P(fio, PSTR("%08lX:\r\n"), addr);
-	for (uint16 i = 0; i < FLASH_PAGE_SIZE >> 4; i++) {
-		fprintf_P(fio, PSTR("%04X: "), i << 4);
-		for (j = 0; j < 16; j++) {
-			b = ReadFlash(FLASH_CONT, 0);
-			fprintf_P(fio, PSTR("%02X "), b);
-			string[j] = isprint(b) ? b : '.';
+		case JOB_ABORT:
+			fputs_P(PSTR("aborted \r\n"), fio);
+			return JOB_FAILED;
+	}
+
+	if (!(sJob.addr % 10240))
+		fprintf_P(fio, PSTR("%ld kb\r"), sJob.addr >> 10);
+
+	// read flash a page at a time, otherwise it's really slow
+	ReadFlash(FLASH_START, sJob.addr);
+	for (j = 0; j < FLASH_PAGE_SIZE; j++) {
+		b = ReadFlash(FLASH_CONT, 0);
+		if (b != 0xFF) {
+			if (++sJob.errors < 30) {
+				EmptyTxBuf();
+				fprintf_P(fio, PSTR("%08lX: %02X\r\n"), sJob.addr, b);
+			}
 		}
-		fputc('\t', fio);
-		fputs(string, fio);
 	}
 	ReadFlash(FLASH_END, 0);
+	sJob.addr += FLASH_PAGE_SIZE;
+
+	if (sJob.errors) {
+		fputs_P(PSTR("failed \r\n"), fio);
+		return JOB_FAILED;
+	}
+	if (sJob.addr < gFlash.capacity)
+		return JOB_BUSY;
+
+	fputs_P(PSTR("passed \r\n"), fio);
+	return JOB_DONE;
 }
 
 //-----------------------------------------------------------------------------
-void EraseFlash(void) {
+void CheckBlank(void) {
+
+	fputs_P(PSTR("Blank check, press 'A' to abort:\r\n"), fio);
+	sJob.addr = 0;
+	sJob.errors = 0;
+	JobStart(CheckBlankStep);
+}
+
+//-----------------------------------------------------------------------------
+//	Copies a sector's worth of flash into BACKUP_FILE per step. It's all read
+//	before the sector is started, as the card can't let go of the bus in the
+//	middle of one.
+//-----------------------------------------------------------------------------
+static uint8 BackupStep(uint8 cmd) {
+
+	uint16 j, n;
+	uint16 t;
+
+	switch (cmd) {
+		case JOB_STATUS:
+			fprintf_P(fio, PSTR("Backing up: %ld kb\r\n"), sJob.addr >> 10);
+			return JOB_BUSY;
+
+		case JOB_POWFAIL:
+		case JOB_ABORT:
+			pf_write(0, 0, &n);
+			SdWriteStop();
+			fputs_P(PSTR("aborted \r\n"), fio);
+			return JOB_FAILED;
+	}
+
+	n = FLASH_PAGE_SIZE;										// half a sector, see disk_writep()
+	ReadFlash(FLASH_START, sJob.addr);
+	for (j = 0; j < n; j++)
+		sJob.crc = _crc_xmodem_update(sJob.crc, sBuffer[j] = ReadFlash(FLASH_CONT, 0));
+	ReadFlash(FLASH_END, 0);
+
+	if ((pf_write(sBuffer, n, &j) != FR_OK) || (j != n)) {
+		SdWriteStop();
+		fputs_P(PSTR("Failed to write SD card\r\n"), fio);
+		return JOB_FAILED;
+	}
+	sJob.addr += n;
+	if (!(sJob.addr & 0xFFFF))
+		fprintf_P(fio, PSTR("%ld kb\r"), sJob.addr >> 10);
+	if (sJob.addr < sJob.end)
+		return JOB_BUSY;
+
+	pf_write(0, 0, &n);
+	SdWriteStop();
+	t = Clock() - sJob.started;
+	fprintf_P(fio, PSTR("%ld kb in %u.%us, CRC %04X\r\n"), sJob.end >> 10, t / TICK_FREQ, t % TICK_FREQ, sJob.crc);
+	return JOB_DONE;
+}
+
+//-----------------------------------------------------------------------------
+//	Starts a job saving the flash to BACKUP_FILE, as much as fits. Returns
+//	true if there is no file to write to.
+//-----------------------------------------------------------------------------
+uint8 CfgBackup(void) {
+
+	fputs_P(PSTR("Backing up to " BACKUP_FILE ":\r\n"), fio);
+	if ((pf_open_P(PSTR(BACKUP_FILE)) != FR_OK) || (gFatFs.fsize < SD_BLOCK_SIZE)) {
+		fprintf_P(fio, PSTR("Put a %lu kb " BACKUP_FILE " on the card first\r\n"), gFlash.capacity >> 10);
+		return true;
+	}
+	sJob.end = gFlash.capacity;
+	if (gFatFs.fsize < sJob.end) {
+		sJob.end = gFatFs.fsize & ~(SD_BLOCK_SIZE - 1ul);
+		fprintf_P(fio, PSTR("only the first %lu kb will fit\r\n"), sJob.end >> 10);
+	}
+	sJob.addr = 0;
+	sJob.crc = 0;
+	sJob.started = Clock();
+	JobStart(BackupStep);
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+//	Prints a page of the hex dump per step, fails if the host stops taking it
+//-----------------------------------------------------------------------------
+static uint8 ExtReadStep(uint8 cmd) {
 
-	fputs_P(PSTR("Erasing flash (takes < 60s...)"), fio);
-	HandleUsb();
+	uint16 j, n;
 
-//	fprintf_P(fio, PSTR(" SR = %02X\r\n"), ReadFlashStatus());
-//	HandleUsb();
+	switch (cmd) {
+		case JOB_STATUS:
+			fprintf_P(fio, PSTR("Dumping: %08lX\r\n"), sJob.addr);
+			return JOB_BUSY;
 
+		case JOB_ABORT:
+			fputs_P(PSTR("aborted \r\n"), fio);
+			return JOB_FAILED;
+	}
+
+	n = (sJob.end - sJob.addr < FLASH_PAGE_SIZE) ? sJob.end - sJob.addr : FLASH_PAGE_SIZE;
+	FlashCommand(gFlash.readOp, sJob.addr);
+	for (j = 0; j < n; j++)
+		sBuffer[j] = SpiTransferByte(0);
+	SpiEnd(SPI_FLASH);
+	for (j = 0; j < n; j += HEX_LINE_BYTES)
+		if (!HexLine(sJob.addr + j, sBuffer + j, (n - j < HEX_LINE_BYTES) ? n - j : HEX_LINE_BYTES))
+			return JOB_FAILED;
+	sJob.addr += n;
+
+	return (sJob.addr < sJob.end) ? JOB_BUSY : JOB_DONE;
+}
+
+//-----------------------------------------------------------------------------
+//	Starts a job printing base to base + size in hex and ASCII
+//-----------------------------------------------------------------------------
+void ExtReadFlash(uint32 base, uint32 size) {
+
+	if (base > gFlash.capacity)
+		base = gFlash.capacity;
+	if (size > gFlash.capacity - base)
+		size = gFlash.capacity - base;
+	sJob.start = sJob.addr = base;
+	sJob.end = base + size;
+	if (size)
+		JobStart(ExtReadStep);
+}
+
+//-----------------------------------------------------------------------------
+//	Prints kb done, elapsed time and an estimate of the time left
+//-----------------------------------------------------------------------------
+static void EraseProgress(void) {
+
+	uint32 done, total;
+	uint16 elapsed, left;
+
+	total = (sJob.end - sJob.start) >> 10;
+	done = (sJob.addr - sJob.start) >> 10;
+	elapsed = Clock() - sJob.started;
+	left = done ? (uint32)elapsed * (total - done) / done : (total >> 6) * ERASE_SECTOR_TIME;
+	fprintf_P(fio, PSTR("\r%lu/%lu kb, %us elapsed, %us left  "),
+			  done, total, elapsed / TICK_FREQ, left / TICK_FREQ);
+}
+
+//-----------------------------------------------------------------------------
+//	Erases a block at a time, using the biggest erase the flash has that fits.
+//	The status register is polled between steps without holding the flash
+//	selected, so USB and the console keep going. An abort suspends the erase
+//	in progress if the flash can do that, otherwise the job stops when the
+//	current erase is finished.
+//-----------------------------------------------------------------------------
+static uint8 EraseFlashStep(uint8 cmd) {
+
+	uint8 t;
+
+	switch (cmd) {
+		case JOB_STATUS:
+			EraseProgress();
+			fputs_P(PSTR("\r\n"), fio);
+			return JOB_BUSY;
+
+		case JOB_POWFAIL:
+		case JOB_ABORT:
+			if (gFlash.suspendOp && FlashBusy()) {
+				SpiBegin(SPI_FLASH, SPI_FAST);
+				SpiTransferByte(gFlash.suspendOp);
+				SpiEnd(SPI_FLASH);
+				WaitForReady();								// suspend latency is a few us
+				sEraseSuspended = true;
+				fputs_P(PSTR("\r\naborted, erase suspended\r\n"), fio);
+				return JOB_FAILED;
+			}
+			sJob.errors = 1;								// stop once the current erase is done
+			break;
+	}
+
+	if (!ErasePollDue() || FlashBusy())
+		return JOB_BUSY;
+
+	// last erase finished
+	if (sJob.errors) {
+		fputs_P(PSTR("\r\naborted \r\n"), fio);
+		return JOB_FAILED;
+	}
+
+	EraseProgress();
+	if (sJob.addr >= sJob.end) {
+		fputs_P(PSTR("\r\ndone\r\n"), fio);
+		StatErased();
+		return JOB_DONE;
+	}
+
+	t = EraseType(sJob.addr, sJob.end);
+	WriteEnable(true);
+	FlashCommand(gFlash.erase[t].op, sJob.addr);
+	SpiEnd(SPI_FLASH);
+	sJob.addr += 1ul << gFlash.erase[t].shift;
+
+	return JOB_BUSY;
+}
+
+//-----------------------------------------------------------------------------
+//	Starts an erase job for start to end, widened to the smallest erase size.
+//	A suspended erase is resumed first, the job waits for it before starting.
+//-----------------------------------------------------------------------------
+void EraseRange(uint32 start, uint32 end) {
+
+	uint32 mask = (1ul << gFlash.erase[gFlash.eraseTypes - 1].shift) - 1;
+
+	if (end > gFlash.capacity)
+		end = gFlash.capacity;
+	sJob.start = sJob.addr = start & ~mask;
+	sJob.end = (end + mask) & ~mask;
+	fprintf_P(fio, PSTR("Erasing %08lX-%08lX, A to abort:\r\n"), sJob.start, sJob.end - 1);
+	if (PowerFail())
+		return;
+
+	ResumeErase();
+	sJob.errors = 0;
+	sJob.started = Clock();
+	StatBegin(sJob.start);
+	JobStart(EraseFlashStep);
+}
+
+//-----------------------------------------------------------------------------
+//	Erases *start to end a block at a time without waiting, for a job step to
+//	call until it returns false. Each call starts the next erase once the last
+//	has finished, and moves *start on past it.
+//-----------------------------------------------------------------------------
+uint8 EraseBlocks(uint32 *start, uint32 end) {
+
+	uint8 t;
+
+	ResumeErase();
+	if (!ErasePollDue() || FlashBusy())
+		return true;
+	if (*start >= end)
+		return false;
+
+	t = EraseType(*start, end);
 	WriteEnable(true);
-	FLASH_SEL;
-	SpiTransferByte(BULK_ERASE);
-	FLASH_DESEL;
+	FlashCommand(gFlash.erase[t].op, *start);
+	SpiEnd(SPI_FLASH);
+	*start += 1ul << gFlash.erase[t].shift;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+//	Programs n bytes within one page and waits, returns true if the supply
+//	is failing and nothing was written
+//-----------------------------------------------------------------------------
+uint8 ProgramFlash(uint32 addr, const uint8 *buf, uint16 n) {
 
+	if (PowerFail())
+		return true;
+	WriteEnable(true);
+	FlashCommand(gFlash.programOp, addr);
+	while (n--)
+		SpiTransferByte(*buf++);
+	SpiEnd(SPI_FLASH);
 	WaitForReady();
-	fputs_P(PSTR(" done\r\n"), fio);
-	FLASH_SEL;
-	FLASH_DESEL;
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+//	The page buffer, for a job whose steps don't read or write the flash
+//	through it, such as SlotTableStep()
+//-----------------------------------------------------------------------------
+uint8 *JobBuffer(void) {
+
+	return sBuffer;
+}
+
+//-----------------------------------------------------------------------------
+void EraseFlash(void) {
+
+	EraseRange(0, gFlash.capacity);
 }
 
 //-----------------------------------------------------------------------------
 void ResetFlash(void) {
 
-	FLASH_SEL;
+	SpiBegin(SPI_FLASH, SPI_FAST);
 	SpiTransferByte(RSTEN);
-	FLASH_DESEL;
-	FLASH_SEL;
+	SpiEnd(SPI_FLASH);
+	SpiBegin(SPI_FLASH, SPI_FAST);
 	SpiTransferByte(RST);
-	FLASH_DESEL;
-	Delay_MS(20);
+	SpiEnd(SPI_FLASH);
+	_delay_us(FLASH_RST_US);
+	for (uint16 n = FLASH_RST_POLLS; n && FlashBusy(); n--);		// longer if it was busy
+	sEraseSuspended = false;										// the reset dropped it
+}
+
+//-----------------------------------------------------------------------------
+//	Reads n bytes of the SFDP tables
+//-----------------------------------------------------------------------------
+static void ReadSfdp(uint32 addr, uint8 *buf, uint8 n) {
+
+	SpiBegin(SPI_FLASH, SPI_FAST);
+	SpiTransferByte(READ_SFDP);
+	SpiTransferByte(addr >> 16);
+	SpiTransferByte(addr >> 8);
+	SpiTransferByte(addr);
+	SpiTransferByte(0);										// dummy byte
+	while (n--)
+		*buf++ = SpiTransferByte(0);
+	SpiEnd(SPI_FLASH);
+}
+
+//-----------------------------------------------------------------------------
+//	Swaps in the 4-byte address opcodes, rather than switching the flash to
+//	4-byte mode, which would leave it unreadable by the FPGA at boot.
+//	Erase sizes with no 4-byte opcode are dropped.
+//-----------------------------------------------------------------------------
+static const uint8 sOps4[][2] PROGMEM = {
+	{SECTOR_ERASE,	SECTOR_ERASE4},
+	{ERASE_32K,		ERASE_32K4},
+	{ERASE_4K,		ERASE_4K4},
+};
+
+static void Use4ByteOps(void) {
+
+	uint8 i, t, n = 0;
+
+	gFlash.readOp = READ_DATA4;
+	gFlash.programOp = PAGE_PROGRAM4;
+	for (t = 0; t < gFlash.eraseTypes; t++) {
+		for (i = 0; i < sizeof(sOps4) / sizeof(sOps4[0]); i++) {
+			if (pgm_read_byte(&sOps4[i][0]) == gFlash.erase[t].op) {
+				gFlash.erase[n].shift = gFlash.erase[t].shift;
+				gFlash.erase[n++].op = pgm_read_byte(&sOps4[i][1]);
+				break;
+			}
+		}
+	}
+	if (!n) {
+		gFlash.erase[n].shift = FLASH_SECTOR_SHIFT;
+		gFlash.erase[n++].op = SECTOR_ERASE4;
+	}
+	gFlash.eraseTypes = n;
+}
+
+//-----------------------------------------------------------------------------
+//	Fills in gFlash from the JEDEC id and the SFDP basic parameter table
+//	(JESD216). Anything the table doesn't cover keeps the PCB default.
+//	Uses the job page buffer, so only call it with no job running.
+//-----------------------------------------------------------------------------
+#define SFDP_DW(n)		LD_DWORD(sBuffer + ((n) - 1) * 4)
+
+void FlashProbe(void) {
+
+	uint8 i, j, n, shift;
+	uint32 dw;
+
+	memset(&gFlash, 0, sizeof(gFlash));
+	gFlash.capacity = MAX_FLASH + 1;
+	gFlash.pageSize = FLASH_PAGE_SIZE;
+	gFlash.addrBytes = 3;
+	gFlash.readOp = READ_DATA;
+	gFlash.programOp = PAGE_PROGRAM;
+	gFlash.eraseTypes = 1;
+	gFlash.erase[0].shift = FLASH_SECTOR_SHIFT;
+	gFlash.erase[0].op = SECTOR_ERASE;
+#if FLASH_SUSPEND
+	gFlash.suspendOp = ERASE_SUSPEND;
+	gFlash.resumeOp = ERASE_RESUME;
+#endif
+
+	SpiBegin(SPI_FLASH, SPI_FAST);
+	SpiTransferByte(READ_ID);
+	for (i = 0; i < 3; i++)
+		gFlash.id[i] = SpiTransferByte(0);
+	SpiEnd(SPI_FLASH);
+
+	// SFDP header, then the first parameter header which must be the basic table
+	ReadSfdp(0, sBuffer, 16);
+	if ((LD_DWORD(sBuffer) != SFDP_SIGNATURE) || sBuffer[8])
+		return;
+	n = sBuffer[11];										// table length in dwords
+	if (n > SFDP_DWORDS)
+		n = SFDP_DWORDS;
+	ReadSfdp(LD_DWORD(sBuffer + 12) & 0x00FFFFFFul, sBuffer, n * 4);
+	gFlash.sfdp = true;
+
+	// DWORD 2: density in bits
+	dw = SFDP_DW(2);
+	if (dw & 0x80000000ul)
+		gFlash.capacity = 1ul << ((dw & 0x7FFFFFFFul) - 3);
+	else
+		gFlash.capacity = (dw >> 3) + 1;
+
+	// DWORD 1 bits 18:17 = 2 for 4-byte addresses only
+	if ((((SFDP_DW(1) >> 17) & 3) == 2) || (gFlash.capacity > 0x01000000ul))
+		gFlash.addrBytes = 4;
+
+	// DWORDs 8 & 9: up to 4 erase types as (2^n size, opcode) byte pairs
+	if (n >= 9) {
+		gFlash.eraseTypes = 0;
+		for (i = 0; i < FLASH_ERASE_TYPES; i++) {
+			if (!(shift = sBuffer[28 + 2 * i]))
+				continue;
+			for (j = gFlash.eraseTypes; j && (gFlash.erase[j - 1].shift < shift); j--)
+				gFlash.erase[j] = gFlash.erase[j - 1];
+			gFlash.erase[j].shift = shift;
+			gFlash.erase[j].op = sBuffer[29 + 2 * i];
+			gFlash.eraseTypes++;
+		}
+		if (!gFlash.eraseTypes)								// none listed, keep the default
+			gFlash.eraseTypes = 1;
+	}
+
+	// DWORD 11 bits 7:4: page size is 2^n
+	if (n >= 11)
+		gFlash.pageSize = 1 << ((SFDP_DW(11) >> 4) & 0x0F);
+
+	// DWORD 12 bit 31 clear if suspend works, DWORD 13 has the opcodes
+	if (n >= 13) {
+		if (SFDP_DW(12) & 0x80000000ul) {
+			gFlash.suspendOp = 0;
+			gFlash.resumeOp = 0;
+		} else {
+			dw = SFDP_DW(13);
+			gFlash.suspendOp = dw >> 24;
+			gFlash.resumeOp = dw >> 16;
+		}
+	}
+
+	if (gFlash.addrBytes == 4)
+		Use4ByteOps();
+}
+
+//-----------------------------------------------------------------------------
+void FlashInfo(void) {
+
+	fprintf_P(fio, PSTR("Flash %02X %02X %02X: %lu kb, %u byte pages, %d byte addresses%S\r\n"),
+			  gFlash.id[0], gFlash.id[1], gFlash.id[2], gFlash.capacity >> 10, gFlash.pageSize,
+			  gFlash.addrBytes, gFlash.sfdp ? PSTR(", from SFDP") : PSTR(""));
+	fputs_P(PSTR("Erase:"), fio);
+	for (uint8 t = 0; t < gFlash.eraseTypes; t++)
+		fprintf_P(fio, PSTR(" %lu kb (%02X)"), (1ul << gFlash.erase[t].shift) >> 10, gFlash.erase[t].op);
+	if (gFlash.suspendOp)
+		fputs_P(PSTR(", suspend"), fio);
+	fputs_P(PSTR("\r\n"), fio);
 }
 
 //-----------------------------------------------------------------------------
 void SpiInit(uint8 on) {
 
+	if (!on)
+		FinishErase();						// the FPGA mustn't boot from a half erased block
+	SpiBus(on);
 	if (on) {
-		FPGA_RESET;							// hold FPGA in reset
-		FLASH_DESEL;
-		FLASH_GRAB;							// make FLASH-CS output
-		FLASH_DESEL;
-		SD_DESEL;
-		SD_GRAB;							// make SD-CS output
-		SD_DESEL;
-		DDRB |= 0b00000110;					// make SPI lines outputs
-
-		// Setup for SPI Mode 0, MSB first, master mode
-		SPSR = 1;							// double speed
-		SPCR = 0b01010000;					// f = FCLK / 2, mode 0
-//		SPCR = 0b01010001;					// f = FCLK / 8, mode 0
-//		SPCR = 0b01010010;					// f = FCLK / 32, mode 0
+		gPowSag = gPowFail;					// a sag before the bus was taken stopped nothing
 		ResetFlash();						// now reset the flash
-	} else {
-		FLASH_DESEL;
-		SD_DESEL;
-		SPCR = 0;							// disable SPI
-		DDRB &= ~0b00000110;				// release SPI lines
-		FLASH_RELEASE;						// release FLASH-CS
-		SD_RELEASE;							// release SD-CS
-		FPGA_RELEASE;
+		FlashProbe();						// and find out what it is
 	}
 }
 
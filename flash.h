@@ -8,26 +8,51 @@
 
 #include "platform.h"
 
+typedef void (*copy_done_t)(uint32 size, uint16 crc);
+
 //uint8 	SpiTransferByte(uint8 send);
 void	WriteFlash(uint8 mode, uint32 address, uint8 data);
 uint8	ReadFlash(uint8 mode, uint32 address);
 void 	EraseFlash(void);
 void	SpiInit(uint8 on);
-void	ExtReadFlash(void);
-uint8	CfgCopy(void);
+void	ExtReadFlash(uint32 base, uint32 size);
+uint8	CfgCopy(const char *name, uint32 base, uint32 limit, uint8 erase, copy_done_t done);
+uint8	CfgResume(void);
+uint8	CfgBackup(void);
+uint16	CfgEraseTicks(void);
+void	CfgCheck(uint32 base, uint32 size, uint16 crc, copy_done_t done);
+void	CfgHash(uint32 base, uint32 size);
+void	CfgDump(uint32 base, uint32 size);
 //void	CfgTest(void);
-void	CfgVerify(void);
+uint8	CfgVerify(void);
 void	CheckBlank(void);
 void	ResetFlash(void);
+void	FlashProbe(void);
+void	FlashInfo(void);
+void	EraseRange(uint32 start, uint32 end);
+uint8	EraseBlocks(uint32 *start, uint32 end);
+uint8	ProgramFlash(uint32 addr, const uint8 *buf, uint16 n);
+uint8	*JobBuffer(void);
+
+#define BACKUP_FILE				"/backup.bin"	// made beforehand, FatFs can't grow it
 
-#if PCB == PCB1V0
+//	Defaults for the part fitted to each PCB, used when the flash has no SFDP
+#if PCB == PCB_1V0
 	#define MAX_FLASH				0x001FFFFFul
 #else
 	#define MAX_FLASH				0x003FFFFFul
 #endif
 #define FLASH_PAGE_SIZE			256
+#define DUMP_ABORTED			0xFFFF		// 'Z' count sent in place of a page when stopped
+#define FLASH_SECTOR_SHIFT		16			// SECTOR_ERASE size is 64k
+#define FLASH_SUSPEND			1			// flash supports ERASE_SUSPEND/ERASE_RESUME
+#define FLASH_ERASE_TYPES		4			// SFDP describes up to 4 erase sizes
 #define DEFAULT_FLASH_TIMEOUT	40			// ms
 #define ERASE_FLASH_TIMEOUT		12000		// ms
+#define ERASE_SECTOR_TIME		7			// typical 64k erase * 100ms, for the first estimate
+#define ERASE_POLL				78			// status poll interval in timer counts (~10ms)
+#define FLASH_RST_US			30			// tRST, before the flash answers at all
+#define FLASH_RST_POLLS			4000		// WIP polls, ~20ms for a reset during an erase
 
 //	Flash commands
 #define WRITE_ENABLE			0x06
@@ -44,6 +69,69 @@ void	ResetFlash(void);
 #define POWER_UP				0xAB
 #define RSTEN					0x66
 #define RST						0x99
+#define ERASE_SUSPEND			0x75
+#define ERASE_RESUME			0x7A
+#define READ_SFDP				0x5A
+
+//	4-byte address versions, the flash stays in 3-byte mode for the FPGA
+#define READ_DATA4				0x13
+#define PAGE_PROGRAM4			0x12
+#define SECTOR_ERASE4			0xDC
+#define ERASE_4K				0x20
+#define ERASE_4K4				0x21
+#define ERASE_32K				0x52
+#define ERASE_32K4				0x5C
+
+#define SFDP_SIGNATURE			0x50444653ul	// "SFDP"
+#define SFDP_DWORDS				13				// basic table dwords used
+
+//	Flash part, filled in by FlashProbe()
+typedef struct {
+	uint8	id[3];						// JEDEC manufacturer, type, capacity
+	uint8	sfdp;						// geometry came from SFDP
+	uint8	addrBytes;					// 3, or 4 for parts over 16MB
+	uint16	pageSize;
+	uint32	capacity;					// bytes
+	uint8	eraseTypes;
+	struct {
+		uint8	shift;					// erase size is 1 << shift
+		uint8	op;
+	} erase[FLASH_ERASE_TYPES];			// biggest first
+	uint8	suspendOp;					// 0 if an erase can't be suspended
+	uint8	resumeOp;
+	uint8	readOp;						// 3 or 4-byte address versions
+	uint8	programOp;
+} FLASH_INFO;
+
+extern FLASH_INFO gFlash;
+
+//	A write records its progress in EEPROM at each sector boundary, so an
+//	interrupted write can be resumed. The progress records go round a ring,
+//	each sector of a write having its own, the newest of the session wins.
+#define CKPT_SIZE		(1ul << FLASH_SECTOR_SHIFT)
+#define CKPT_RING		16
+#define CKPT_NEWEST		0xFFFFFFFFul		// no checkpoint has this address
+
+typedef struct {
+	uint8	active;						// a write is unfinished
+	uint8	session;					// of the progress records
+	uint8	erase;
+	uint8	suspect;					// the supply was failing when it stopped
+	uint32	base;
+	uint32	limit;
+	uint32	size;						// of the image
+	uint32	fsize;						// file size and first cluster, to open it again
+	uint32	clust;
+	char	name[13];					// as given to CfgCopy(), empty for the default
+} CKPT_HDR;
+
+typedef struct {
+	uint32	addr;						// everything below is written
+	uint16	crc;						// of the image up to addr
+	uint16	sectorCrc;					// of the sector below addr
+	uint8	session;					// written last
+	uint8	spare;
+} CKPT_REC;
 
 // write modes - used by & ReadFlash()
 #define FLASH_START		0x01
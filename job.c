@@ -0,0 +1,105 @@
+//-----------------------------------------------------------------------------
+//	Turtle Board Atmel Code
+//	job.c
+//	Runs one long-running programmer command a step at a time
+//-----------------------------------------------------------------------------
+#include <stdio.h>
+
+#include "platform.h"
+#include "Turtle.h"
+#include "job.h"
+#include "stats.h"
+
+static job_step_t	sStep;						// step function of the running job, 0 if idle
+static uint8		sAbort;
+static job_step_t	sNext;						// runs if the current job finishes OK
+
+//-----------------------------------------------------------------------------
+//	Returns false if a job is already running
+//-----------------------------------------------------------------------------
+uint8 JobStart(job_step_t step) {
+
+	if (sStep)
+		return false;
+
+	sAbort = false;
+	sStep = step;
+	sNext = 0;
+	gFlags.ledState = LED_MED;
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+uint8 JobBusy(void) {
+
+	return sStep != 0;
+}
+
+//-----------------------------------------------------------------------------
+//	Called from a step about to finish, runs step after it if it succeeds
+//-----------------------------------------------------------------------------
+void JobThen(job_step_t step) {
+
+	sNext = step;
+}
+
+//-----------------------------------------------------------------------------
+//	Called just after JobStart(), runs step first and the job's own step after
+//	it if it succeeds
+//-----------------------------------------------------------------------------
+void JobBefore(job_step_t step) {
+
+	sNext = sStep;
+	sStep = step;
+}
+
+//-----------------------------------------------------------------------------
+//	The abort is passed to the job on its next step
+//-----------------------------------------------------------------------------
+void JobAbort(void) {
+
+	sAbort = true;
+}
+
+//-----------------------------------------------------------------------------
+void JobStatus(void) {
+
+	if (sStep)
+		sStep(JOB_STATUS);
+}
+
+//-----------------------------------------------------------------------------
+//	Called from the main loop, runs one step of the current job
+//-----------------------------------------------------------------------------
+void JobTask(void) {
+
+	uint8 cmd, res;
+
+	if (!sStep)
+		return;
+
+	cmd = sAbort ? JOB_ABORT : gPowSag ? JOB_POWFAIL : JOB_STEP;
+	sAbort = false;								// a job that can't stop just carries on
+
+	res = sStep(cmd);
+	if (cmd == JOB_POWFAIL)
+		gPowSag = false;						// the job has seen it
+	if (res == JOB_BUSY)
+		return;
+
+	if ((res == JOB_DONE) && sNext) {
+		sStep = sNext;
+		sNext = 0;
+		return;
+	}
+
+	sStep = 0;
+	sNext = 0;
+	gFlags.error = (res != JOB_DONE);
+	StatEnd(gFlags.error);
+	if (gFlags.error)
+		gFlags.ledState = LED_FAST;
+	else if (gFlags.ledState == LED_MED)				// unless the job set its own
+		gFlags.ledState = LED_IDLE;
+}
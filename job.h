@@ -0,0 +1,35 @@
+//-----------------------------------------------------------------------------
+//	Turtle Board Atmel Code
+//	job.h
+//-----------------------------------------------------------------------------
+#ifndef JOB_H_
+#define JOB_H_
+
+#include "platform.h"
+
+// Long-running commands are split into steps that each do a small amount of
+// work (a page or a status poll) and return, so the main loop keeps servicing
+// USB, the button and the UART bridge between steps.
+
+// step commands, passed to the step function
+#define JOB_STEP		0			// do the next piece of work
+#define JOB_ABORT		1			// user asked to stop - tidy up or ignore
+#define JOB_STATUS		2			// print progress, must not change state
+#define JOB_POWFAIL		3			// supply failing - jobs that write stop, others carry on as JOB_STEP
+
+// step results
+#define JOB_BUSY		0			// call again
+#define JOB_DONE		1			// finished OK
+#define JOB_FAILED		2			// finished with an error or aborted
+
+typedef uint8 (*job_step_t)(uint8 cmd);
+
+uint8	JobStart(job_step_t step);
+void	JobThen(job_step_t step);
+void	JobBefore(job_step_t step);
+uint8	JobBusy(void);
+void	JobAbort(void);
+void	JobStatus(void);
+void	JobTask(void);
+
+#endif
@@ -698,6 +698,8 @@ void get_fileinfo (		/* No return code */
 		fno->fsize = LD_DWORD(dir+DIR_FileSize);	/* Size */
 		fno->fdate = LD_WORD(dir+DIR_WrtDate);		/* Date */
 		fno->ftime = LD_WORD(dir+DIR_WrtTime);		/* Time */
+		fno->fclust = LD_CLUST(dir);				/* Start cluster */
+		fno->findex = dj->index;					/* Where it is in the directory */
 	}
 	*p = 0;
 }
@@ -936,6 +938,44 @@ FRESULT pf_open (
 	return FR_OK;
 }
 
+/*-----------------------------------------------------------------------*/
+/* Open a File named in program memory, so the name takes no RAM         */
+/*-----------------------------------------------------------------------*/
+FRESULT pf_open_P (
+	PGM_P path			/* Pointer to the file name in flash */
+)
+{
+	char p[_MAX_PATH_P];
+
+	strncpy_P(p, path, sizeof(p) - 1);
+	p[sizeof(p) - 1] = 0;
+	return pf_open(p);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Open a File found earlier, without searching the directory            */
+/*-----------------------------------------------------------------------*/
+
+FRESULT pf_openclust (
+	CLUST clust,		/* File start cluster, from pf_readdir() */
+	uint32 size			/* File size */
+)
+{
+	if (!gFatFs.init) {						/* Check file system */
+		return FR_NOT_ENABLED;
+	}
+
+	gFatFs.org_clust = clust;
+	gFatFs.fsize = size;
+	gFatFs.fptr = 0;
+	gFatFs.flag = FA_OPENED;
+
+	return FR_OK;
+}
+
 
 /*-----------------------------------------------------------------------*/
 /* Read File                                                             */
@@ -1119,7 +1159,7 @@ FRESULT pf_lseek (
 //	FATFS *fs = gFatFs;
 
 
-	if (!gFatFs) {
+	if (!gFatFs.init) {
 		return FR_NOT_ENABLED;		/* Check file system */
 	}
 	if (!(gFatFs.flag & FA_OPENED)) {		/* Check if opened */
@@ -1205,6 +1245,21 @@ FRESULT pf_opendir (
 	return res;
 }
 
+/*-----------------------------------------------------------------------*/
+/* Open a Directory named in program memory                              */
+/*-----------------------------------------------------------------------*/
+FRESULT pf_opendir_P (
+	DIR *dj,			/* Pointer to directory object to create */
+	PGM_P path			/* Pointer to the directory path in flash */
+)
+{
+	char p[_MAX_PATH_P];
+
+	strncpy_P(p, path, sizeof(p) - 1);
+	p[sizeof(p) - 1] = 0;
+	return pf_opendir(dj, p);
+}
+
 /*-----------------------------------------------------------------------*/
 /* Read Directory Entry in Sequense                                      */
 /*-----------------------------------------------------------------------*/
@@ -1242,5 +1297,26 @@ FRESULT pf_readdir (
 	return res;
 }
 
+/*-----------------------------------------------------------------------*/
+/* Move to a Directory Entry, by the index pf_readdir() gave it          */
+/*-----------------------------------------------------------------------*/
+FRESULT pf_seekdir (
+	DIR *dj,			/* Pointer to the open directory object */
+	uint16 index		/* Entry index, from FILINFO.findex */
+)
+{
+	FRESULT res;
+
+	if (!gFatFs.init) {				/* Check file system */
+		return FR_NOT_ENABLED;
+	}
+	res = dir_rewind(dj);
+	while (res == FR_OK && dj->index < index) {
+		res = dir_next(dj);			/* Only reads the FAT at cluster changes */
+	}
+
+	return res;
+}
+
 #endif /* _USE_DIR */
 
@@ -30,13 +30,15 @@
 
 #define	_USE_DIR	1	/* 1:Enable pf_opendir() and pf_readdir() */
 
-//#define	_USE_LSEEK	1	/* 1:Enable pf_lseek() */
+#define	_USE_LSEEK	1	/* 1:Enable pf_lseek() */
 
-//#define	_USE_WRITE	1	/* 1:Enable pf_write() */
+#define	_USE_WRITE	1	/* 1:Enable pf_write() */
 
 //#define _FS_FAT12	1	/* 1:Enable FAT12 support */
 #define _FS_FAT32	1	/* 1:Enable FAT32 support */
 
+#define _MAX_PATH_P	16	/* Buffer for a path in program memory, with the terminator */
+
 
 #define	_CODE_PAGE	1
 /* Defines which code page is used for path name. Supported code pages are:
@@ -112,6 +114,8 @@ typedef struct {
 	uint16	ftime;		/* Last modified time */
 	uint8	fattrib;	/* Attribute */
 	char	fname[13];	/* File name */
+	CLUST	fclust;		/* Start cluster, for pf_openclust() */
+	uint16	findex;		/* Directory index, for pf_seekdir() */
 } FILINFO;
 
 
@@ -138,11 +142,15 @@ extern FATFS gFatFs;	/* Pointer to the file system object (logical drive) */
 
 FRESULT pf_mount (uint8);						/* Mount/Unmount a logical drive */
 FRESULT pf_open (const char*);					/* Open a file */
+FRESULT pf_open_P (PGM_P);						/* Open a file named in program memory */
+FRESULT pf_openclust (CLUST, uint32);			/* Open a file by start cluster and size */
 FRESULT pf_read (void*, uint16, uint16*);			/* Read data from the open file */
 FRESULT pf_write (const void*, uint16, uint16*);	/* Write data to the open file */
 FRESULT pf_lseek (uint32);						/* Move file pointer of the open file */
 FRESULT pf_opendir (DIR*, const char*);			/* Open a directory */
+FRESULT pf_opendir_P (DIR*, PGM_P);				/* Open a directory named in program memory */
 FRESULT pf_readdir (DIR*, FILINFO*);			/* Read a directory item from the open directory */
+FRESULT pf_seekdir (DIR*, uint16);				/* Move to a directory item by its index */
 
 
 
@@ -0,0 +1,94 @@
+//-----------------------------------------------------------------------------
+//	Turtle Board Atmel Code
+//	prod.c
+//	Unattended programming for the production jig, started by a long press
+//	or an autorun file: mount, write erasing only what the image needs, then
+//	check the CRC read back. LED_SLOW at the end is a pass, LED_FAST a fail.
+//-----------------------------------------------------------------------------
+#include <stdio.h>
+
+#include "platform.h"
+#include "Turtle.h"
+#include "flash.h"
+#include "pff.h"
+#include "bitstream.h"
+#include "prod.h"
+
+static struct {
+	uint16	start;							// Clock() at each phase end
+	uint16	mounted;
+	uint16	written;
+	uint16	checked;
+	uint16	erase;							// ticks of the write waiting on erases
+	uint32	size;
+} sProd;
+
+//-----------------------------------------------------------------------------
+static void PrintTicks(PGM_P name, uint16 ticks) {
+
+	fprintf_P(fio, PSTR("%S %u.%us"), name, ticks / TICK_FREQ, ticks % TICK_FREQ);
+}
+
+//-----------------------------------------------------------------------------
+//	Prints the phase times of the last run
+//-----------------------------------------------------------------------------
+void ProdReport(void) {
+
+	if (!sProd.checked)
+		return;
+	fprintf_P(fio, PSTR("%lu bytes: "), sProd.size);
+	PrintTicks(PSTR("mount"), sProd.mounted - sProd.start);
+	PrintTicks(PSTR(", write"), sProd.written - sProd.mounted);
+	PrintTicks(PSTR(" (erase"), sProd.erase);
+	PrintTicks(PSTR("), check"), sProd.checked - sProd.written);
+	PrintTicks(PSTR(", total"), sProd.checked - sProd.start);
+	fputs_P(PSTR("\r\n"), fio);
+}
+
+//-----------------------------------------------------------------------------
+static void ProdChecked(uint32 size, uint16 crc) {
+
+	sProd.checked = Clock();
+	gFlags.ledState = LED_SLOW;
+	fputs_P(PSTR("Production run passed\r\n"), fio);
+	ProdReport();
+}
+
+//-----------------------------------------------------------------------------
+static void ProdWritten(uint32 size, uint16 crc) {
+
+	sProd.written = Clock();
+	sProd.erase = CfgEraseTicks();
+	sProd.size = size;
+	CfgCheck(0, size, crc, ProdChecked);
+}
+
+//-----------------------------------------------------------------------------
+//	Starts a run, the job carries it on. Programmer mode must be on.
+//-----------------------------------------------------------------------------
+void ProdStart(void) {
+
+	fputs_P(PSTR("\r\nProduction run\r\n"), fio);
+	sProd.start = Clock();
+	sProd.checked = 0;
+	gFlags.error = false;
+
+	pf_mount(false);											// the card may have been swapped
+	if (pf_mount(true) == FR_OK)
+		BitIndex();
+	sProd.mounted = Clock();
+
+	if (!gFlags.sdOk || CfgCopy(0, 0, gFlash.capacity, true, ProdWritten)) {
+		fputs_P(PSTR("Production run failed\r\n"), fio);
+		gFlags.error = true;
+		gFlags.ledState = LED_FAST;
+	}
+}
+
+//-----------------------------------------------------------------------------
+//	True if the card has the autorun file
+//-----------------------------------------------------------------------------
+uint8 ProdAutorun(void) {
+
+	return gFlags.sdOk && (pf_open_P(PSTR(PROD_AUTORUN)) == FR_OK);
+}
@@ -0,0 +1,16 @@
+//-----------------------------------------------------------------------------
+//	Turtle Board Atmel Code
+//	prod.h
+//-----------------------------------------------------------------------------
+#ifndef PROD_H_
+#define PROD_H_
+
+#include "platform.h"
+
+void	ProdStart(void);
+uint8	ProdAutorun(void);
+void	ProdReport(void);
+
+#define PROD_AUTORUN		"/autorun"		// starts a run when programmer mode is entered
+
+#endif
@@ -0,0 +1,172 @@
+//-----------------------------------------------------------------------------
+//	Turtle Board Atmel Code
+//	script.c
+//	Runs the commands in SCRIPT_FILE a line at a time, each one once the job
+//	started by the one before has finished, and stops at the first error.
+//	The other files the commands open close the script, so it is opened
+//	again and the position restored for each line.
+//-----------------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "platform.h"
+#include "Turtle.h"
+#include "sd.h"
+#include "job.h"
+#include "script.h"
+
+static struct {
+	uint8	running;
+	uint8	step;							// a step is running
+	uint16	line;
+	uint32	offset;							// of the next line in the file
+	uint16	started;						// Clock() at the start of the step
+	uint16	wait;							// ticks to wait for '@'
+	char	*next;							// next argument character of the line running, 0 if none
+} sScript;
+
+//-----------------------------------------------------------------------------
+//	Returns true if the script file can't be opened
+//-----------------------------------------------------------------------------
+uint8 ScriptStart(void) {
+
+	if (pf_open_P(PSTR(SCRIPT_FILE)) != FR_OK) {
+		fputs_P(PSTR("No " SCRIPT_FILE "\r\n"), fio);
+		return true;
+	}
+
+	sScript.running = true;
+	sScript.step = false;
+	sScript.line = 0;
+	sScript.offset = 0;
+	fputs_P(PSTR("Running " SCRIPT_FILE ", A to stop\r\n"), fio);
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+//	Stops after the running step
+//-----------------------------------------------------------------------------
+void ScriptStop(void) {
+
+	if (!sScript.running)
+		return;
+	sScript.running = false;
+	fprintf_P(fio, PSTR("Script stopped at line %u\r\n"), sScript.line);
+}
+
+//-----------------------------------------------------------------------------
+uint8 ScriptRunning(void) {
+
+	return sScript.running;
+}
+
+//-----------------------------------------------------------------------------
+void ScriptStatus(void) {
+
+	if (sScript.running)
+		fprintf_P(fio, PSTR("Script line %u\r\n"), sScript.line);
+}
+
+//-----------------------------------------------------------------------------
+//	Gives the command run from the script its arguments, then the end of line.
+//	Returns false when no script command is running.
+//-----------------------------------------------------------------------------
+uint8 ScriptGetch(char *c) {
+
+	if (!sScript.next)
+		return false;
+	*c = *sScript.next ? *sScript.next++ : '\r';
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+//	Finishes the step that is running, returns false if it isn't done yet
+//-----------------------------------------------------------------------------
+static uint8 StepDone(void) {
+
+	uint16 t = Clock() - sScript.started;
+
+	if (JobBusy() || (t < sScript.wait))
+		return false;
+
+	sScript.step = false;
+	fprintf_P(fio, PSTR("line %u: %u.%us\r\n"), sScript.line, t / TICK_FREQ, t % TICK_FREQ);
+	if (gFlags.error)
+		ScriptStop();
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+//	Called from the main loop, starts the next line when the last is done
+//-----------------------------------------------------------------------------
+void ScriptTask(void) {
+
+	char buf[SCRIPT_LINE];
+	uint8 res;
+	char *p;
+
+	if (!sScript.running)
+		return;
+	if (!gFlags.pgmMode) {									// X ends it
+		sScript.running = false;
+		return;
+	}
+	if (sScript.step && (!StepDone() || !sScript.running))
+		return;
+
+	// the next line
+	FpgaHold();
+	if (((res = pf_open_P(PSTR(SCRIPT_FILE))) != FR_OK) || ((res = pf_lseek(sScript.offset)) != FR_OK) ||
+		((res = ReadLine(buf, SCRIPT_LINE)) != FR_OK)) {
+		sScript.running = false;
+		if (res != FR_EOF) {
+			fputs_P(PSTR("Failed to read " SCRIPT_FILE "\r\n"), fio);
+			gFlags.error = true;
+			gFlags.ledState = LED_FAST;
+			return;
+		}
+		fputs_P(PSTR("Script done\r\n"), fio);
+		gFlags.ledState = LED_IDLE;
+		return;
+	}
+	sScript.offset = gFatFs.fptr;
+	sScript.line++;
+	if ((p = strpbrk_P(buf, PSTR("\r\n"))))
+		*p = '\0';
+	if (!buf[0] || (buf[0] == '#'))
+		return;
+
+	fprintf_P(fio, PSTR("\r\n%u: %s\r\n"), sScript.line, buf);
+	sScript.step = true;
+	sScript.started = Clock();
+	sScript.wait = 0;
+	gFlags.error = false;
+
+	switch (buf[0]) {
+		case '@':
+			sScript.wait = (atol(buf + 1) * TICK_FREQ + 999) / 1000;
+			break;
+
+		case '>':
+			fprintf_P(fio, PSTR("%s\r\n"), buf + 1);
+			break;
+
+		case '!':
+			FpgaRun();
+			sScript.wait = (atol(buf + 1) * TICK_FREQ + 999) / 1000;
+			break;
+
+		default:
+			if (strchr_P(PSTR(SCRIPT_BARRED), toupper(buf[0]))) {
+				fputs_P(PSTR("Not allowed in a script\r\n"), fio);
+				gFlags.error = true;
+				break;
+			}
+			sScript.next = buf + 1;
+			RunCommand(buf[0]);
+			sScript.next = 0;
+			break;
+	}
+}
@@ -0,0 +1,28 @@
+//-----------------------------------------------------------------------------
+//	Turtle Board Atmel Code
+//	script.h
+//-----------------------------------------------------------------------------
+#ifndef SCRIPT_H_
+#define SCRIPT_H_
+
+#include "platform.h"
+
+uint8	ScriptStart(void);
+void	ScriptStop(void);
+uint8	ScriptRunning(void);
+void	ScriptStatus(void);
+void	ScriptTask(void);
+uint8	ScriptGetch(char *c);
+
+// Each line of the script is a command letter and its arguments separated by
+// spaces, as they would be typed, e.g. "O 1 test.bit" or "K 10000 110000".
+// The script can also have
+//	@ms		wait
+//	!ms		reset the FPGA and let it run for ms, the next line takes the bus back
+//	>text	print the text
+//	#text	comment
+#define SCRIPT_FILE			"/turtle.txt"
+#define SCRIPT_LINE			40
+#define SCRIPT_BARRED		"DRX"			// would restart the script or leave programmer mode
+
+#endif
@@ -17,16 +17,30 @@
 #include "sd.h"
 #include "pff.h"
 #include "flash.h"
+#include "spi.h"
+#include <util/crc16.h>
 
 volatile	uint8	gSdTimeout, gSdTimeout2;
 static		uint8	sCardType;
+static		uint16	sReadPolls = SD_READ_US / SD_POLL_US;	// data token wait, from the CSD
+static		uint16	sBusyPolls = SD_BUSY_US / SD_POLL_US;	// write busy wait, from the CSD
+static		uint16	sCrcErrors;								// since power up
+static		uint16	sRetries;
+static		uint32	sWriteNext;								// sector after an open CMD25 run, 0 if none
+static		uint16	sWriteLeft;								// bytes of the block still to send
+static		uint16	sWriteCrc;
+
+// mantissa * 10 of the TAAC and TRAN_SPEED fields of the CSD
+static const uint8 sCsdValue[16] PROGMEM = {
+	0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80
+};
 
 //-----------------------------------------------------------------------------
 static uint8 SpiTransfer(uint8 data) {
 	
 	SPDR = data;
 //	while (!(SPSR & 0x80));
-	for (gSdTimeout = SD_TIMEOUT; gSdTimeout && !(SPSR & 0x80); );
+	for (uint8 n = SD_SPIF_POLLS; n && !(SPSR & 0x80); n--);
 //	if (!gSdTimeout)
 //		fputc('a', fio);
 	data = SPDR;
@@ -37,30 +51,49 @@ static uint8 SpiTransfer(uint8 data) {
 //-----------------------------------------------------------------------------
 static void SdDeselect(void) {
 
-	SD_DESEL;
+	SpiEnd(SPI_SD);
 	SpiTransfer(0xFF);
 }
 
+//-----------------------------------------------------------------------------
+//	Waits while the card is busy, returns false if it stays busy
+//-----------------------------------------------------------------------------
+static uint8 WaitReady(void) {
+
+	uint16 n;
+
+	for (n = sBusyPolls; n && (SpiTransfer(0xFF) != 0xFF); n--);
+	return n != 0;
+}
+
 //-----------------------------------------------------------------------------
 static uint8 SdSelect(void) {
 
-	SD_SEL;
+	SpiBegin(SPI_SD, SPI_FAST);
 	SpiTransfer(0xFF);
 
 //	while (SpiTransfer(0xFF) != 0xFF);
-	for (gSdTimeout2 = SD_TIMEOUT; !gSdTimeout2 && (SpiTransfer(0xFF) != 0xFF); );
-/*	if (!gSdTimeout) {
-		fputc('b', fio);
-		return false;
-	} else
-		return true;*/
-	return gSdTimeout2;
+	return WaitReady();
+}
+
+//-----------------------------------------------------------------------------
+//	Adds a byte to the CRC7 of a command
+//-----------------------------------------------------------------------------
+static uint8 Crc7(uint8 crc, uint8 b) {
+
+	for (uint8 i = 0; i < 8; i++) {
+		crc <<= 1;
+		if ((b ^ crc) & 0x80)
+			crc ^= 0x09;
+		b <<= 1;
+	}
+	return crc;
 }
 
 //-----------------------------------------------------------------------------
 static uint8 SendCommand(uint8 command, uint32 arg) {
 
-	uint8 ret = 0;
+	uint8 ret = 0, crc = 0, b;
 
 	if (command & 0x80) {					// ACMD<n> is the command sequence of CMD55-CMD<n>
 		command &= 0x7F;
@@ -76,26 +109,17 @@ static uint8 SendCommand(uint8 command, uint32 arg) {
 		return 0xFF;
 	}
 
-	SpiTransfer(command | 0x40);
-	SpiTransfer((uint8)(arg >> 24));
-	SpiTransfer((uint8)(arg >> 16));
-	SpiTransfer((uint8)(arg >> 8));
-	SpiTransfer((uint8)arg);
-	switch (command) {						// checksum - only needed for certain commands
-		case CMD0:
-			SpiTransfer(0x95);
-			break;
-		case CMD8:
-			SpiTransfer(0x87);
-			break;
-		default:
-			SpiTransfer(0xFF);
-			break;
+	// the CRC is only needed for CMD0 and CMD8 until CMD59 turns checking on
+	crc = Crc7(crc, b = command | 0x40);
+	SpiTransfer(b);
+	for (int8 i = 24; i >= 0; i -= 8) {
+		crc = Crc7(crc, b = arg >> i);
+		SpiTransfer(b);
 	}
+	SpiTransfer((crc << 1) | 1);
 
 	// wait for response
-	gSdTimeout2 = TICK_FREQ * 2;
-	while (gSdTimeout2) {
+	for (uint8 n = SD_NCR_POLLS; n; n--) {
 		if (!((ret = SpiTransfer(0xFF)) & 0x80))
 			return ret;
 	}
@@ -108,25 +132,207 @@ static uint8 SendCommand(uint8 command, uint32 arg) {
 	return ret;
 }
 
+//-----------------------------------------------------------------------------
+//	Waits for the data token, returns false if it doesn't come
+//-----------------------------------------------------------------------------
+static uint8 DataToken(void) {
+
+	uint16 n;
+
+	for (n = sReadPolls; n && (SpiTransfer(0xFF) != 0xFE); n--);
+	return n != 0;
+}
+
+//-----------------------------------------------------------------------------
+//	Reads a data block len bytes long, keeping cnt bytes from offs, and checks
+//	its CRC. The CRC of each byte is worked out while the next comes in.
+//-----------------------------------------------------------------------------
+static uint8 ReadData(uint8 *buf, uint16 offs, uint16 cnt, uint16 len) {
+
+	uint16 crc = 0;
+	uint8 b;
+
+	if (!DataToken())
+		return SD_DATA_TIMEOUT;
+
+	SPDR = 0xFF;
+	for (uint16 i = 0; i < len + 2; i++) {
+		while (!(SPSR & 0x80));
+		b = SPDR;
+		if (i < len + 1)
+			SPDR = 0xFF;										// next byte
+		if (i < len) {
+			crc = _crc_xmodem_update(crc, b);
+			if ((uint16)(i - offs) < cnt)
+				*buf++ = b;
+		} else
+			crc ^= (i == len) ? (uint16)b << 8 : b;				// 0 if it matches
+	}
+#if SD_CRC
+	if (crc) {
+		sCrcErrors++;
+		return SD_DATA_CRC;
+	}
+#endif
+	return SD_DATA_OK;
+}
+
+//-----------------------------------------------------------------------------
+//	Reads the CSD or CID, returns false if the card won't give it
+//-----------------------------------------------------------------------------
+static uint8 ReadRegister(uint8 command, uint8 *buf) {
+
+	uint8 ok;
+
+	ok = (SendCommand(command, 0) == 0) && (ReadData(buf, 0, SD_REG_SIZE, SD_REG_SIZE) == SD_DATA_OK);
+	SdDeselect();
+	return ok;
+}
+
+//-----------------------------------------------------------------------------
+//	TAAC or TRAN_SPEED: unit is the power of 10 of the units
+//-----------------------------------------------------------------------------
+static uint32 CsdValue(uint8 field, uint8 unit) {
+
+	uint32 v = pgm_read_byte(&sCsdValue[(field >> 3) & 0x0F]);
+
+	for (unit += field & 0x07; unit; unit--)
+		v *= 10;
+	return v / 10;
+}
+
+//-----------------------------------------------------------------------------
+//	Polls in us, no fewer than SD_MIN_US and no more than max
+//-----------------------------------------------------------------------------
+static uint16 Polls(uint32 us, uint32 max) {
+
+	if (us < SD_MIN_US)
+		us = SD_MIN_US;
+	if (us > max)
+		us = max;
+	return us / SD_POLL_US;
+}
+
+//-----------------------------------------------------------------------------
+//	Reads the CSD and CID, prints what they say, and sets the read and busy
+//	waits from the access time. Cards that don't give them keep the longest.
+//-----------------------------------------------------------------------------
+static void CardInfo(void) {
+
+	uint8 csd[SD_REG_SIZE], cid[SD_REG_SIZE];
+	uint32 size, us;
+
+	sReadPolls = SD_READ_US / SD_POLL_US;
+	sBusyPolls = SD_BUSY_US / SD_POLL_US;
+
+	if (ReadRegister(CMD10, cid) && !(sCardType & CT_MMC))
+		fprintf_P(fio, PSTR("Maker %02X %.2s, %.5s rev %u.%u, serial %08lX, made %u/%u\r\n"),
+			cid[0], cid + 1, cid + 3, cid[8] >> 4, cid[8] & 0x0F,
+			((uint32)cid[9] << 24) | ((uint32)cid[10] << 16) | ((uint16)cid[11] << 8) | cid[12],
+			cid[14] & 0x0F, 2000 + ((cid[13] & 0x0F) << 4) + (cid[14] >> 4));
+
+	if (!ReadRegister(CMD9, csd)) {
+		fputs_P(PSTR("No CSD\r\n"), fio);
+		return;
+	}
+
+	if ((csd[0] >> 6) == 1) {								// CSD 2.0, SDHC and SDXC
+		size = ((((uint32)csd[7] & 0x3F) << 16) | ((uint16)csd[8] << 8) | csd[9]) + 1;
+		size >>= 1;											// in MB
+		us = SD_READ_US;									// fixed for these cards
+	} else {
+		size = ((((uint16)csd[6] & 0x03) << 10) | ((uint16)csd[7] << 2) | (csd[8] >> 6)) + 1;
+		size <<= (((csd[9] & 0x03) << 1) | (csd[10] >> 7)) + 2 + (csd[5] & 0x0F);
+		size >>= 20;
+		// 100 times TAAC + NSAC * 100 clocks, at the SPI clock of FCLK / 2
+		us = 100 * (CsdValue(csd[1], 0) / 1000 + (uint32)csd[2] * 100 / (F_CPU / 2000000ul));
+	}
+	sReadPolls = Polls(us, SD_READ_US);
+	sBusyPolls = Polls(us << ((csd[12] >> 2) & 0x07), SD_BUSY_US);	// times R2W_FACTOR
+
+	fprintf_P(fio, PSTR("%lu MB, TAAC %lu ns + %u clocks, up to %lu kbit/s, waits %u/%u ms\r\n"),
+		size, CsdValue(csd[1], 0), csd[2] * 100, CsdValue(csd[3], 2),
+		sReadPolls / (1000 / SD_POLL_US), sBusyPolls / (1000 / SD_POLL_US));
+}
+
+//-----------------------------------------------------------------------------
+//	Polls to wait for a write to finish, from the CSD
+//-----------------------------------------------------------------------------
+uint16 SdBusyPolls(void) {
+
+	return sBusyPolls;
+}
+
+//-----------------------------------------------------------------------------
+//	Prints the read errors since power up
+//-----------------------------------------------------------------------------
+void SdInfo(void) {
+
+#if SD_CRC
+	fprintf_P(fio, PSTR("SD reads: %u CRC errors, %u retries\r\n"), sCrcErrors, sRetries);
+#else
+	fprintf_P(fio, PSTR("SD reads: CRC not checked, %u retries\r\n"), sRetries);
+#endif
+}
+
+//-----------------------------------------------------------------------------
+//	CT_ flags of the card last initialised
+//-----------------------------------------------------------------------------
+uint8 CardType(void) {
+
+	return sCardType;
+}
+
+//-----------------------------------------------------------------------------
+//	Checks that a card which answered SEND_STATUS addresses blocks the way
+//	sCardType says, a different card may have been put in, and sets the
+//	block length and CRC checking again. Returns false if it needs the full
+//	initialisation.
+//-----------------------------------------------------------------------------
+static uint8 StillReady(void) {
+
+	uint8 ocr[4];
+
+	if (SendCommand(CMD58, 0) != 0)
+		return false;
+	for (uint8 i = 0; i < 4; i++)
+		ocr[i] = SpiTransfer(0xFF);
+	if (!(ocr[0] & 0x80) || (!(ocr[0] & 0x40) != !(sCardType & CT_BLOCK)))	// powered up, CCS
+		return false;
+	if (!(sCardType & CT_BLOCK) && (SendCommand(CMD16, SD_BLOCK_SIZE) != 0))
+		return false;
+#if SD_CRC
+	if (SendCommand(CMD59, 1) != 0)
+		fputs_P(PSTR("CRC checking not on\r\n"), fio);
+#endif
+	SdDeselect();
+	return true;
+}
+
 //-----------------------------------------------------------------------------
 //	Powers up the disc and initialises it into SPI mode
 //-----------------------------------------------------------------------------
 DSTATUS disk_initialize(void) {
 
 	uint8 ret = STA_NOINIT;
-	uint8 spi;
+
+	sWriteNext = 0;
+
+	// A card still initialised from last time answers SEND_STATUS, and needn't
+	// go through it all again. A new card isn't in SPI mode so says nothing,
+	// one that's been reset says it's idle.
+	if (sCardType && (SendCommand(CMD13, 0) == 0)) {
+		SpiTransfer(0xFF);					// rest of the R2
+		if (StillReady())
+			return 0;
+	}
+	sCardType = 0;
 	
 	// Init the card in SPI mode by sending clks for 2 ms @ 250 kHz
-	spi = SPCR;								// store previous setting
-	SPCR = 0b01010010;						// f = FCLK / 32 = 250kHz, mode 0
-
-	SD_DESEL;
+	SpiBegin(SPI_SD_INIT, SPI_SLOW);
 	for (uint16 i = 0; i < 200; i++)
 		SpiTransfer(0xFF);
-	
-	SD_SEL;
-	
-	SPCR = spi;								// restore SPI speed
+	SpiEnd(SPI_SD_INIT);
 
 	// Send CMD0 GO_IDLE_STATE
 	gSdTimeout = SD_TIMEOUT;
@@ -193,13 +399,19 @@ DSTATUS disk_initialize(void) {
 	}
 
 	// everything hunky dory
+#if SD_CRC
+	if (SendCommand(CMD59, 1) != 0)
+		fputs_P(PSTR("CRC checking not on\r\n"), fio);
+#endif
+	CardInfo();
 	ret = 0;
 
 SdPowerExit:
 	if (ret) {
+		sCardType = 0;
 		fputs_P(PSTR("SD error\r\n"), fio);
 	} 
-	SD_DESEL;
+	SpiEnd(SPI_SD);
 
 	return ret;
 }
@@ -210,139 +422,142 @@ SdPowerExit:
 DRESULT disk_readp(uint8 *buff, uint32 blockNum, uint16 offs, uint16 cnt) {
 
 	DRESULT res = RES_ERROR;
-	uint8 r, *p;
+	uint8 r;
 		
 //	printf_P(PSTR("disk_readp(,0x%X, %d, %d)\r\n"), (int)blockNum, offs, cnt);
 	
+	SdWriteStop();								// reads can't come in a write run
 	if (!(sCardType & CT_BLOCK))
 		blockNum <<= 9;							// multiply by SD_BLOCK_SIZE
 
-	// read the block from the card
-	if ((r = SendCommand(CMD17, blockNum)) != 0) {
-		fprintf_P(fio, PSTR("\tCMD17(%X) returned %d\r\n"), blockNum, r);
-		goto ReadBlockExit;
+	// read the block from the card, again if it's corrupted or late
+	for (uint8 tries = 0; (res != RES_OK) && (tries < SD_RETRIES); tries++) {
+		if (tries)
+			sRetries++;
+		if ((r = SendCommand(CMD17, blockNum)) != 0)
+			fprintf_P(fio, PSTR("\tCMD17(%lX) returned %d\r\n"), blockNum, r);
+		else if (ReadData(buff, offs, cnt, SD_BLOCK_SIZE) == SD_DATA_OK)
+			res = RES_OK;
+		SdDeselect();
 	}
-
-	// wait for data token
-	gSdTimeout2 = TICK_FREQ / 4;
-	while (SpiTransfer(0xFF) != 0xFE) {
-		if (!gSdTimeout2) {
-//			fputc('f', fio);
-			goto ReadBlockExit;
-		}
-	}
-
-	// read the block
-	p = buff;
-	uint16 i;
-	for (i = 0; i < offs; i++)
-		SpiTransfer(0xFF);
-	for ( ; i < offs + cnt; i++)
-		*p++ = SpiTransfer(0xFF);
-	for (; i < SD_BLOCK_SIZE; i++)
-		SpiTransfer(0xFF);
-
-	res = RES_OK;
-
-ReadBlockExit:
-	SdDeselect();
 //	printf_P(PSTR"Read block returned %d\r\n", res);
 	
 	return res;
 }
 
 //-----------------------------------------------------------------------------
-FRESULT ReadLine(char *p, uint16 maxLen) {
-	
-	uint16 bytesRead;
-	FRESULT res;
-	uint16 len = 0;
-	char c;
+//	Ends an open CMD25 run of sectors
+//-----------------------------------------------------------------------------
+void SdWriteStop(void) {
 
-	maxLen--;
-	do {
-		res = pf_read(&c, 1, &bytesRead);
-		if (res != FR_OK) {
-			return res;
-		}
-		if (bytesRead != 1) {
-			return FR_EOF;
-		}
-		if (++len < maxLen) {
-			*p++ = c;
-		}
-	} while (c != '\n');
-	*p = '\0';
-	
-	return FR_OK;
+	if (!sWriteNext)
+		return;
+	sWriteNext = 0;
+	SpiBegin(SPI_SD, SPI_FAST);
+	SpiTransfer(0xFD);							// stop token
+	SpiTransfer(0xFF);
+	WaitReady();
+	SdDeselect();
 }
 
 //-----------------------------------------------------------------------------
-/*static uint8 ChooseFile(uint32 *size) {
-	
-	uint8 res;
-	DIR dir;
-	int i, nFiles;
-	FILINFO fno;		// File information
-	char s[25];
-	
-	res = pf_opendir(&dir, "FPGA");
-	if (res) {
-		fprintf_P(fio, PSTR("opendir() returned %d\r\n"), res);
-		return res;
-	}
-	
-	nFiles = 1;
-	for (;;) {
-		res = pf_readdir(&dir, &fno);
-		if (res != FR_OK) {
-			fprintf_P(fio, PSTR("readdir() returned %d\r\n"), res);
-			break;
-		}
+//	Petit FatFs write, in three parts:
+//		disk_writep(0, sector) starts a sector
+//		disk_writep(buff, n) sends n bytes of it, as often as needed
+//		disk_writep(0, 0) ends it, padding it out with zeros
+//	A sector that follows the last one carries on the CMD25 run. The card is
+//	deselected after the data token and after each piece of data, without
+//	further clocks, so the flash can be read into the page buffer between
+//	pieces. The SD spec only lets CS go high while the card is busy, but
+//	with it high the card ignores the clock; a card that loses its place
+//	fails the data CRC, and the write returns an error.
+//-----------------------------------------------------------------------------
+DRESULT disk_writep(const uint8 *buff, uint32 sc) {
 
-		if (!fno.fname[0])				// end of directory
-			break;
+	DRESULT res = RES_ERROR;
+	uint32 addr = sc;
 
-		if (fno.fattrib & AM_DIR) {
-			fprintf_P(fio, PSTR("\t   <DIR>   %s\r\n"), fno.fname);
-		} else {
-			fprintf_P(fio, PSTR("\t%d\t%s\t%9lu\r\n"), nFiles, fno.fname, fno.fsize);
+	if (buff) {
+		SpiBegin(SPI_SD, SPI_FAST);
+		for (uint16 bc = sc; bc && sWriteLeft; bc--, sWriteLeft--) {
+			sWriteCrc = _crc_xmodem_update(sWriteCrc, *buff);
+			SpiTransfer(*buff++);
 		}
-		nFiles++;
+		SpiEnd(SPI_SD);
+		return RES_OK;
 	}
-	nFiles--;
-	fprintf_P(fio, PSTR("%d item(s)\r\n"), nFiles);
-
-	// ask which file to load
-	fputs_P(PSTR("Select file number (0 to abort)\r\n"), fio);
-	for (i = 0; i < 5; i++) {
-		UartGetch(&s[i]);
-		if ((s[i] == '\r') || (s[i] == '\n')) {
-			s[i] = '\0';
-			break;
-		}
+
+	if (sc) {									// start a sector
+		if (sc != sWriteNext) {
+			SdWriteStop();
+			if (!(sCardType & CT_BLOCK))
+				addr <<= 9;						// multiply by SD_BLOCK_SIZE
+			if (SendCommand(SD_MULTI_WRITE ? CMD25 : CMD24, addr) != 0) {
+				SdDeselect();
+				return RES_ERROR;
+			}
+		} else
+			SpiBegin(SPI_SD, SPI_FAST);
+		SpiTransfer(0xFF);
+		SpiTransfer(SD_MULTI_WRITE ? 0xFC : 0xFE);	// data token
+		SpiEnd(SPI_SD);
+		sWriteNext = SD_MULTI_WRITE ? sc + 1 : 0;
+		sWriteLeft = SD_BLOCK_SIZE;
+		sWriteCrc = 0;
+		return RES_OK;
 	}
-	i = atoi(s);
-	if (i > nFiles) {
-		fputs_P(PSTR("Invalid file number\r\n"), fio);
-		return FR_EOF;
+
+	// end the sector
+	SpiBegin(SPI_SD, SPI_FAST);
+	for ( ; sWriteLeft; sWriteLeft--) {
+		sWriteCrc = _crc_xmodem_update(sWriteCrc, 0);
+		SpiTransfer(0);
+	}
+	SpiTransfer(sWriteCrc >> 8);
+	SpiTransfer(sWriteCrc);
+	if (((SpiTransfer(0xFF) & 0x1F) == 0x05) && WaitReady())	// data accepted
+		res = RES_OK;
+	else if (sWriteNext) {
+		sWriteNext = 0;
+		SendCommand(CMD12, 0);					// abandon the run
+		WaitReady();
 	}
+	SdDeselect();
+	return res;
+}
+
+//-----------------------------------------------------------------------------
+//	Reads a line, newline and all, into p and leaves the file at the start of
+//	the next. A block is read at once and the file pointer set back to just
+//	past the newline. A line too long for p is cut short.
+//-----------------------------------------------------------------------------
+FRESULT ReadLine(char *p, uint16 maxLen) {
 	
-	// open file
-	fprintf_P(fio, PSTR("Opening file #%d\r\n"), i);
-	res = pf_opendir(&dir, "FPGA");
-	for (int j = 1; j < i; j++)
-		res = pf_readdir(&dir, &fno);
-		
-	strcpy_P(s, PSTR("/FPGA/"));
-	strcat(s, fno.fname);;
-	if ((res = pf_open(s)) != FR_OK) {
-		fprintf_P(fio, PSTR("Unable to open file #%d:%s\tpf_open() returned %d\r\n"), i, s, res);
+	uint16 bytesRead;
+	uint32 pos = gFatFs.fptr;
+	FRESULT res;
+	char *nl, skip[16];
+
+	if ((res = pf_read(p, maxLen - 1, &bytesRead)) != FR_OK)
 		return res;
+	if (!bytesRead)
+		return FR_EOF;
+	p[bytesRead] = '\0';
+	if ((nl = memchr(p, '\n', bytesRead))) {
+		nl[1] = '\0';
+		return pf_lseek(pos + (nl - p) + 1);
 	}
-	
-	*size = fno.fsize;
+	if (bytesRead < maxLen - 1)						// last line has no newline
+		return FR_OK;
 
-	return res;
-}*/
+	for (;;) {										// pass over the rest of a long one
+		pos = gFatFs.fptr;
+		if ((res = pf_read(skip, sizeof(skip), &bytesRead)) != FR_OK)
+			return res;
+		if ((nl = memchr(skip, '\n', bytesRead)))
+			return pf_lseek(pos + (nl - skip) + 1);
+		if (bytesRead < sizeof(skip))
+			return FR_OK;
+	}
+}
 
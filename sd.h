@@ -28,6 +28,23 @@ typedef enum {
 //#define SD_TIMEOUT			TICK_FREQ / 2
 #define SD_TIMEOUT			2				// * 100ms
 
+// Short waits count polls, SpiTransfer(0xFF) calls, rather than ticks
+#define SD_POLL_US			5				// one poll at FCLK / 2, roughly
+#define SD_SPIF_POLLS		255				// for a byte, even at FCLK / 32
+#define SD_NCR_POLLS		16				// for a command response, 8 at most
+#define SD_READ_US			100000ul		// most the data token can take
+#define SD_BUSY_US			250000ul		// most a write can take
+#define SD_MIN_US			10000ul			// least wait, whatever the CSD says
+#define SD_REG_SIZE			16				// CSD and CID
+#define SD_CRC				1				// check the CRC of data read, with CMD59
+#define SD_RETRIES			3				// reads of a block before giving up
+#define SD_MULTI_WRITE		1				// write runs of sectors with CMD25, else CMD24
+
+// ReadData() results
+#define SD_DATA_OK			0
+#define SD_DATA_TIMEOUT		1
+#define SD_DATA_CRC			2
+
 /* Card type flags (sCardType) */
 #define CT_MMC				0x01	/* MMC ver 3 */
 #define CT_SD1				0x02	/* SD ver 1 */
@@ -58,14 +75,19 @@ typedef enum {
 #define CMD38				38				// ERASE_BLOCKS
 #define CMD55				55				// APP_CMD
 #define CMD58				58				// READ_OCR
+#define CMD59				59				// CRC_ON_OFF
 
 extern volatile	uint8	gSdTimeout, gSdTimeout2;
 //extern			uint8 	gSdBlock[SD_BLOCK_SIZE];
 
 DRESULT disk_readp (uint8 *, uint32, uint16, uint16);
 DSTATUS disk_initialize(void);
-//DRESULT disk_writep (const BYTE*, DWORD);
+DRESULT disk_writep (const uint8 *, uint32);
+void	SdWriteStop(void);
 //void	ReadDir(void);
-//FRESULT ReadLine(char *p, int maxLen);
+FRESULT ReadLine(char *p, uint16 maxLen);
+uint8	CardType(void);
+uint16	SdBusyPolls(void);
+void	SdInfo(void);
 
 #endif
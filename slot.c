@@ -0,0 +1,355 @@
+//-----------------------------------------------------------------------------
+//	Turtle Board Atmel Code
+//	slot.c
+//	Several configurations in the flash, the FPGA's multiboot header picks
+//	the one it boots
+//-----------------------------------------------------------------------------
+#include <stdio.h>
+#include <string.h>
+#include <avr/eeprom.h>
+
+#include "platform.h"
+#include "Turtle.h"
+#include "flash.h"
+#include "job.h"
+#include "slot.h"
+
+// record SlotTableStep() is adding, and what it has to do first
+static struct {
+	uint8		header;						// multiboot header to write, for SlotActivate()
+	uint8		compact;					// table being erased to make room
+	uint8		saved;						// records kept in the page buffer meanwhile
+	uint32		addr;						// erase in progress
+	uint32		end;
+	SLOT_REC	rec;
+} sTable;
+
+// slot whose activation has erased the multiboot header and not yet written
+// the new one, SLOT_FREE if none
+static uint8 EEMEM	eActivating = SLOT_FREE;
+
+// Spartan-6 multiboot header (UG380), with GENERAL1/2 set to the slot to
+// boot and GENERAL3/4 to the golden image, then IPROG
+static const uint8 sMultiboot[MULTIBOOT_SIZE] PROGMEM = {
+	0xFF, 0xFF, 0xFF, 0xFF,					// dummy
+	0xAA, 0x99, 0x55, 0x66,					// sync
+	0x32, 0x61, 0x00, 0x00,					// GENERAL1: multiboot address 15:0
+	0x32, 0x81, MULTIBOOT_READ, 0x00,		// GENERAL2: opcode, address 23:16
+	0x32, 0xA1, 0x00, 0x00,					// GENERAL3: golden address 15:0
+	0x32, 0xC1, MULTIBOOT_READ, 0x00,		// GENERAL4: opcode, address 23:16
+	0x30, 0xA1, 0x00, 0x0E,					// CMD: IPROG
+	0x20, 0x00, 0x20, 0x00,					// NOOP
+	0x20, 0x00, 0x20, 0x00
+};
+
+//-----------------------------------------------------------------------------
+static uint32 TableAddr(void) {
+
+	return gFlash.capacity - SLOT_TABLE_SIZE;
+}
+
+//-----------------------------------------------------------------------------
+static uint32 SlotAddr(uint8 slot) {
+
+	return SLOT_BASE + slot * SLOT_SIZE;
+}
+
+//-----------------------------------------------------------------------------
+//	Number of slots that fit below the table
+//-----------------------------------------------------------------------------
+static uint8 SlotCount(void) {
+
+	uint8 n;
+
+	for (n = 0; (n < SLOT_COUNT) && (SlotAddr(n + 1) <= TableAddr()); n++);
+	return n;
+}
+
+//-----------------------------------------------------------------------------
+//	Reads the first n bytes of the record at addr
+//-----------------------------------------------------------------------------
+static void ReadRec(uint32 addr, void *rec, uint8 n) {
+
+	uint8 *p = rec;
+
+	ReadFlash(FLASH_START, addr);
+	while (--n)
+		*p++ = ReadFlash(FLASH_CONT, 0);
+	*p = ReadFlash(FLASH_END, 0);
+}
+
+//-----------------------------------------------------------------------------
+//	Where the next record goes, gFlash.capacity if the table is full. Records
+//	are only added after the last one, so the end is found by halving.
+//-----------------------------------------------------------------------------
+static uint32 TableEnd(void) {
+
+	uint16 lo = 0, hi = SLOT_TABLE_SIZE / SLOT_REC_SIZE, mid;
+	uint8 type;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		ReadRec(TableAddr() + (uint32)mid * SLOT_REC_SIZE, &type, 1);
+		if (type == SLOT_FREE)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return TableAddr() + (uint32)lo * SLOT_REC_SIZE;
+}
+
+//-----------------------------------------------------------------------------
+//	Finds the newest record below end with a type from type to type + n - 1,
+//	reading only the type of the others. Returns false if there is none.
+//-----------------------------------------------------------------------------
+static uint8 FindRecord(uint8 type, uint8 n, uint32 end, SLOT_REC *rec) {
+
+	while (end > TableAddr()) {
+		end -= SLOT_REC_SIZE;
+		ReadRec(end, rec, 1);
+		if ((rec->type >= type) && (rec->type < type + n)) {
+			ReadRec(end, rec, sizeof(SLOT_REC));
+			return true;
+		}
+	}
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+//	Reads the newest record of a slot, false if the slot is empty
+//-----------------------------------------------------------------------------
+static uint8 SlotInfo(uint8 slot, uint32 end, SLOT_REC *rec) {
+
+	return FindRecord(SLOT_INFO + slot, 1, end, rec) && rec->size;
+}
+
+//-----------------------------------------------------------------------------
+//	Active slot, SLOT_FREE if none
+//-----------------------------------------------------------------------------
+static uint8 ActiveSlot(uint32 end) {
+
+	SLOT_REC rec;
+
+	return FindRecord(SLOT_ACTIVE, SLOT_COUNT, end, &rec) ? rec.type - SLOT_ACTIVE : SLOT_FREE;
+}
+
+//-----------------------------------------------------------------------------
+//	Copies what a full table holds, the newest record of each written slot
+//	and the active one, to the page buffer to be written back once the table
+//	is erased. Returns the number of records.
+//-----------------------------------------------------------------------------
+static uint8 TableSave(void) {
+
+	SLOT_REC rec;
+	uint8 *buf = JobBuffer();
+	uint8 i, n = 0;
+
+	memset(buf, 0xFF, FLASH_PAGE_SIZE);
+	for (i = 0; i < SLOT_COUNT; i++)
+		if (SlotInfo(i, gFlash.capacity, &rec))
+			memcpy(buf + n++ * SLOT_REC_SIZE, &rec, sizeof(rec));
+	if ((i = ActiveSlot(gFlash.capacity)) != SLOT_FREE)
+		buf[n++ * SLOT_REC_SIZE] = SLOT_ACTIVE + i;			// only the type matters
+	return n;
+}
+
+//-----------------------------------------------------------------------------
+//	Writes the multiboot header for a slot into the erased first block,
+//	returns true if the supply is failing
+//-----------------------------------------------------------------------------
+static uint8 WriteHeader(uint8 slot) {
+
+	uint8 *hdr = JobBuffer();
+	uint32 addr = SlotAddr(slot);
+
+	memcpy_P(hdr, sMultiboot, MULTIBOOT_SIZE);
+	hdr[10] = addr >> 8;
+	hdr[11] = addr;
+	hdr[15] = addr >> 16;
+	addr = SlotAddr(0);										// golden
+	hdr[18] = addr >> 8;
+	hdr[19] = addr;
+	hdr[23] = addr >> 16;
+
+	if (ProgramFlash(0, hdr, MULTIBOOT_SIZE))
+		return true;
+	fprintf_P(fio, PSTR("Slot %d active, boots on the next FPGA reset\r\n"), slot);
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+//	Adds sTable.rec to the table. A full table is erased and the newest
+//	records written back first. It's a job step so the erases, of the table
+//	or of the multiboot header's block, don't hold up USB. Only a failing
+//	supply stops it, as records are missing until it's done.
+//-----------------------------------------------------------------------------
+static uint8 SlotTableStep(uint8 cmd) {
+
+	uint32 addr;
+
+	switch (cmd) {
+		case JOB_STATUS:
+			fputs_P(PSTR("Updating the slot table\r\n"), fio);
+			return JOB_BUSY;
+
+		case JOB_POWFAIL:
+			fputs_P(PSTR("supply failing, slot table not updated\r\n"), fio);
+			return JOB_FAILED;
+	}
+
+	if (EraseBlocks(&sTable.addr, sTable.end))
+		return JOB_BUSY;
+
+	if (sTable.header) {
+		if (WriteHeader(sTable.rec.type - SLOT_ACTIVE))
+			return JOB_FAILED;
+		sTable.header = false;
+	}
+
+	if (sTable.compact) {
+		addr = TableAddr();
+		if (sTable.saved) {
+			if (ProgramFlash(addr, JobBuffer(), sTable.saved * SLOT_REC_SIZE))
+				return JOB_FAILED;
+			addr += sTable.saved * SLOT_REC_SIZE;
+		}
+	} else if ((addr = TableEnd()) >= gFlash.capacity) {
+		sTable.saved = TableSave();
+		sTable.compact = true;
+		sTable.addr = TableAddr();
+		sTable.end = gFlash.capacity;
+		return JOB_BUSY;
+	}
+	if (ProgramFlash(addr, (uint8 *)&sTable.rec, sizeof(SLOT_REC)))
+		return JOB_FAILED;
+	if (sTable.rec.type >= SLOT_ACTIVE)
+		eeprom_update_byte(&eActivating, SLOT_FREE);
+	return JOB_DONE;
+}
+
+//-----------------------------------------------------------------------------
+//	Gets SlotTableStep() ready to add sTable.rec, writing the multiboot header
+//	first if header is true
+//-----------------------------------------------------------------------------
+static void TableStart(uint8 header) {
+
+	sTable.header = header;
+	sTable.compact = false;
+	sTable.addr = 0;
+	sTable.end = header ? MULTIBOOT_SIZE : 0;
+}
+
+//-----------------------------------------------------------------------------
+//	Called by the write job when the image is in, adds the slot's record
+//	once the job is done
+//-----------------------------------------------------------------------------
+static void SlotWritten(uint32 size, uint16 crc) {
+
+	sTable.rec.size = size;
+	sTable.rec.crc = crc;
+	TableStart(false);
+	JobThen(SlotTableStep);
+}
+
+//-----------------------------------------------------------------------------
+//	Called when a resumed write finishes, records the image if base is a slot
+//-----------------------------------------------------------------------------
+void SlotResumed(uint32 base, uint32 size, uint16 crc, const char *name) {
+
+	for (uint8 slot = 0; slot < SlotCount(); slot++) {
+		if (SlotAddr(slot) == base) {
+			memset(&sTable.rec, 0, sizeof(sTable.rec));
+			sTable.rec.type = SLOT_INFO + slot;
+			strncpy(sTable.rec.name, name, sizeof(sTable.rec.name) - 1);
+			SlotWritten(size, crc);
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+//	Starts writing the named file, or the default image, into a slot. Once
+//	the file has opened the slot is recorded as empty, before the job
+//	changes it, and reads as empty until the write has finished.
+//-----------------------------------------------------------------------------
+uint8 SlotWrite(uint8 slot, const char *name) {
+
+	uint8 res;
+
+	if (slot >= SlotCount()) {
+		fprintf_P(fio, PSTR("No slot %d\r\n"), slot);
+		return true;
+	}
+	if ((res = CfgCopy(name, SlotAddr(slot), SlotAddr(slot) + SLOT_SIZE, true, SlotWritten)))
+		return res;
+
+	memset(&sTable.rec, 0, sizeof(sTable.rec));
+	sTable.rec.type = SLOT_INFO + slot;
+	if (name)
+		strncpy(sTable.rec.name, name, sizeof(sTable.rec.name) - 1);
+	TableStart(false);
+	JobBefore(SlotTableStep);
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+//	Starts a job pointing the multiboot header at a slot. The EEPROM notes
+//	the slot until the header and its record are written, so SlotRepair()
+//	can finish the job if the power goes.
+//-----------------------------------------------------------------------------
+uint8 SlotActivate(uint8 slot) {
+
+	SLOT_REC rec;
+
+	if ((slot >= SlotCount()) || !SlotInfo(slot, TableEnd(), &rec)) {
+		fprintf_P(fio, PSTR("Slot %d is empty\r\n"), slot);
+		return true;
+	}
+
+	memset(&sTable.rec, 0xFF, sizeof(sTable.rec));			// only the type matters
+	sTable.rec.type = SLOT_ACTIVE + slot;
+	TableStart(true);
+	eeprom_update_byte(&eActivating, slot);
+	JobStart(SlotTableStep);
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+//	Starts again an activation that a power cut stopped, called on entering
+//	programmer mode. Until then the header block may be erased, which the
+//	FPGA reads through to the golden image. Returns true if it started the
+//	job.
+//-----------------------------------------------------------------------------
+uint8 SlotRepair(void) {
+
+	uint8 slot = eeprom_read_byte(&eActivating);
+
+	if (slot == SLOT_FREE)
+		return false;
+	fprintf_P(fio, PSTR("Activating slot %d didn't finish, starting it again\r\n"), slot);
+	if (!SlotActivate(slot))
+		return true;
+	eeprom_update_byte(&eActivating, SLOT_FREE);
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+void SlotList(void) {
+
+	SLOT_REC rec;
+	uint32 end;
+	uint8 i, n, active;
+
+	if (!(n = SlotCount()))
+		fputs_P(PSTR("Flash too small for slots\r\n"), fio);
+
+	end = TableEnd();
+	active = ActiveSlot(end);
+	for (i = 0; i < n; i++) {
+		fprintf_P(fio, PSTR("%c%d %08lX "), (i == active) ? '*' : ' ', i, SlotAddr(i));
+		if (SlotInfo(i, end, &rec)) {
+			rec.name[sizeof(rec.name) - 1] = '\0';
+			fprintf_P(fio, PSTR("%7lu bytes, CRC %04X %s\r\n"), rec.size, rec.crc, rec.name);
+		} else
+			fputs_P(PSTR("empty\r\n"), fio);
+	}
+}
@@ -0,0 +1,41 @@
+//-----------------------------------------------------------------------------
+//	Turtle Board Atmel Code
+//	slot.h
+//-----------------------------------------------------------------------------
+#ifndef SLOT_H_
+#define SLOT_H_
+
+#include "platform.h"
+
+uint8	SlotWrite(uint8 slot, const char *name);
+uint8	SlotActivate(uint8 slot);
+uint8	SlotRepair(void);
+void	SlotList(void);
+void	SlotResumed(uint32 base, uint32 size, uint16 crc, const char *name);
+
+// Flash layout: the multiboot header in the first block, then the slots,
+// slot 0 being the golden image the FPGA falls back to. The slot table is
+// a log of records in the last 64k, the newest record for a slot wins.
+#define SLOT_COUNT			3
+#define SLOT_BASE			0x010000ul
+#define SLOT_SIZE			0x100000ul
+#define SLOT_TABLE_SIZE		0x10000ul
+#define SLOT_REC_SIZE		32				// so records never straddle a page
+
+// record types
+#define SLOT_INFO			0x00			// + slot, image size and CRC
+#define SLOT_ACTIVE			0x40			// + slot, written by SlotActivate()
+#define SLOT_FREE			0xFF
+
+#define MULTIBOOT_READ		0x03			// read opcode for the FPGA to use
+#define MULTIBOOT_SIZE		36
+
+typedef struct {
+	uint8	type;
+	uint8	spare;
+	uint16	crc;							// CRC16 (XMODEM) of the image
+	uint32	size;							// 0 while being written
+	char	name[13];						// file it came from
+} SLOT_REC;
+
+#endif
@@ -0,0 +1,202 @@
+//-----------------------------------------------------------------------------
+//	Turtle Board Atmel Code
+//	spi.c
+//	Hands the bus to the flash and the SD card in turn, see spi.h.
+//	Transfers on the SPI bus either polled or driven by the transfer complete
+//	interrupt, so the main loop can carry on while a block goes through.
+//	At FCLK / 2 a byte takes 16 cycles, less than the ISR costs, so the
+//	interrupt only pays off when the bus is slower or the CPU has better
+//	things to do than wait; 'J' measures both.
+//-----------------------------------------------------------------------------
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+#include <stdio.h>
+
+#include "platform.h"
+#include "Turtle.h"
+#include "flash.h"
+#include "spi.h"
+
+SPI_BUS gSpi;
+#if SPI_BENCH
+static SPI_XFER * volatile sXfer;					// running, 0 if none
+#endif
+
+//-----------------------------------------------------------------------------
+//	Takes over the bus, holding the FPGA in reset, or gives it back
+//-----------------------------------------------------------------------------
+void SpiBus(uint8 on) {
+
+	gSpi.owner = SPI_NONE;
+	if (on) {
+		FPGA_RESET;							// hold FPGA in reset
+		FLASH_DESEL;
+		FLASH_GRAB;							// make FLASH-CS output
+		FLASH_DESEL;
+		SD_DESEL;
+		SD_GRAB;							// make SD-CS output
+		SD_DESEL;
+		DDRB |= 0b00000110;					// make SPI lines outputs
+
+		// Setup for SPI Mode 0, MSB first, master mode
+		SPSR = 1;							// double speed
+		SPCR = SPI_FAST;
+	} else {
+		FLASH_DESEL;
+		SD_DESEL;
+		SPCR = 0;							// disable SPI
+		DDRB &= ~0b00000110;				// release SPI lines
+		FLASH_RELEASE;						// release FLASH-CS
+		SD_RELEASE;							// release SD-CS
+		FPGA_RELEASE;
+	}
+}
+
+//-----------------------------------------------------------------------------
+//	A device was selected while another had the bus, deselects both
+//-----------------------------------------------------------------------------
+void SpiClash(void) {
+
+	FLASH_DESEL;
+	SD_DESEL;
+	if (gSpi.clashes < 255)
+		gSpi.clashes++;
+}
+
+//-----------------------------------------------------------------------------
+void SpiInfo(void) {
+
+	fprintf_P(fio, PSTR("SPI bus: %u overlapping selects\r\n"), gSpi.clashes);
+}
+
+#if SPI_BENCH
+//-----------------------------------------------------------------------------
+//	Takes in the byte just clocked and sends the next
+//-----------------------------------------------------------------------------
+ISR(SPI_STC_vect) {
+
+	SPI_XFER *x = sXfer;
+	uint8 b = SPDR;
+
+	if (x->rx)
+		*x->rx++ = b;
+	if (--x->len) {
+		SPDR = x->tx ? *x->tx++ : x->fill;
+		return;
+	}
+	SPCR &= ~(1 << SPIE);
+	sXfer = 0;
+	if (x->done)
+		x->done();
+}
+
+//-----------------------------------------------------------------------------
+//	Starts a transfer and returns, x must stay put until it's done
+//-----------------------------------------------------------------------------
+void SpiStart(SPI_XFER *x) {
+
+	if (!x->len) {
+		if (x->done)
+			x->done();
+		return;
+	}
+	(void)SPSR;											// clear a SPIF left by polling
+	(void)SPDR;
+	sXfer = x;
+	SPCR |= (1 << SPIE);
+	SPDR = x->tx ? *x->tx++ : x->fill;
+}
+
+//-----------------------------------------------------------------------------
+uint8 SpiBusy(void) {
+
+	return sXfer != 0;
+}
+
+//-----------------------------------------------------------------------------
+//	Does the same transfer as SpiStart, waiting on each byte
+//-----------------------------------------------------------------------------
+void SpiPolled(SPI_XFER *x) {
+
+	for ( ; x->len; x->len--) {
+		SPDR = x->tx ? *x->tx++ : x->fill;
+		while (!(SPSR & 0x80));
+		if (x->rx)
+			*x->rx++ = SPDR;
+	}
+	if (x->done)
+		x->done();
+}
+
+//-----------------------------------------------------------------------------
+//	Timer 1 counts since power up, 128us each
+//-----------------------------------------------------------------------------
+static uint32 Counts(void) {
+
+	uint32 t;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		t = TCNT1;
+		if ((TIFR1 & (1 << OCF1A)) && (t < OCR1A / 2))		// wrapped, tick not counted yet
+			t += OCR1A + 1;
+		t += (uint32)gClock * (OCR1A + 1);
+	}
+	return t;
+}
+
+//-----------------------------------------------------------------------------
+//	Clocks SPI_BENCH_BYTES in transfers of len bytes, receiving them or
+//	sending them, and returns the timer counts taken. spare counts the
+//	times round the wait loop while the ISR did the work.
+//-----------------------------------------------------------------------------
+static uint32 BenchRun(uint8 irq, uint8 send, uint8 len, uint32 *spare) {
+
+	uint8 buf[SPI_BENCH_MAX];
+	SPI_XFER x;
+	uint32 t;
+
+	*spare = 0;
+	t = Counts();
+	for (uint16 n = SPI_BENCH_BYTES / len; n; n--) {
+		x.tx = send ? buf : 0;
+		x.rx = send ? 0 : buf;
+		x.len = len;
+		x.fill = 0xFF;
+		x.done = 0;
+		if (!irq)
+			SpiPolled(&x);
+		else {
+			SpiStart(&x);
+			while (SpiBusy())
+				(*spare)++;
+		}
+	}
+	return Counts() - t + 1;
+}
+
+//-----------------------------------------------------------------------------
+//	Reads the flash, whose data out is ignored when sending, polled and by
+//	interrupt, and prints the rates in kB/s
+//-----------------------------------------------------------------------------
+void SpiBench(void) {
+
+	static const uint8 cmd[4] = {READ_DATA, 0, 0, 0};
+	SPI_XFER x = {cmd, 0, sizeof(cmd), 0, 0};
+	uint32 polled, irq, spare;
+
+	fputs_P(PSTR("\t\tlength\tpolled\tISR\tspare loops\r\n"), fio);
+	SpiBegin(SPI_FLASH, SPI_FAST);
+	SpiPolled(&x);
+	for (uint8 send = 0; send < 2; send++) {
+		for (uint16 len = 4; len <= SPI_BENCH_MAX; len <<= 2) {
+			polled = BenchRun(false, send, len, &spare);
+			irq = BenchRun(true, send, len, &spare);
+			fprintf_P(fio, PSTR("\t%S\t%u\t%lu\t%lu\t%lu\r\n"), send ? PSTR("send") : PSTR("receive"), len,
+				SPI_BENCH_BYTES * (F_CPU / 1024ul) / 1024 / polled,
+				SPI_BENCH_BYTES * (F_CPU / 1024ul) / 1024 / irq, spare);
+		}
+	}
+	SpiEnd(SPI_FLASH);
+}
+#endif
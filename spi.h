@@ -0,0 +1,92 @@
+//-----------------------------------------------------------------------------
+//	Turtle Board Atmel Code
+//	spi.h
+//-----------------------------------------------------------------------------
+#ifndef SPI_H_
+#define SPI_H_
+
+#include <avr/io.h>
+
+#include "platform.h"
+
+// The flash, the SD card and the FPGA share the bus. Each access to the flash
+// or the card is bracketed by SpiBegin() and SpiEnd(), which set the clock
+// and the chip select. Beginning while another device has the bus is a bug:
+// it's counted, and both are deselected before going on. These are inline
+// so that a select costs a few cycles more than the bare macro.
+
+// devices, as bits
+#define SPI_NONE			0
+#define SPI_FLASH			1
+#define SPI_SD				2
+#define SPI_SD_INIT			4				// the card's init clocks, deselected
+
+// SPCR for mode 0, master, with SPI2X set by SpiBus()
+#define SPI_FAST			0b01010000		// FCLK / 2
+#define SPI_SLOW			0b01010010		// FCLK / 32
+
+typedef struct {
+	uint8	owner;
+	uint8	clashes;						// overlapping begins since power up
+} SPI_BUS;
+
+extern SPI_BUS gSpi;
+
+void	SpiBus(uint8 on);
+void	SpiClash(void);
+void	SpiInfo(void);
+
+//-----------------------------------------------------------------------------
+static inline void SpiBegin(uint8 dev, uint8 clock) {
+
+	if (gSpi.owner & ~dev)
+		SpiClash();
+	gSpi.owner = dev;
+	SPCR = clock;
+	if (dev == SPI_FLASH)
+		FLASH_SEL;
+	else if (dev == SPI_SD)
+		SD_SEL;
+}
+
+//-----------------------------------------------------------------------------
+static inline void SpiEnd(uint8 dev) {
+
+	if (dev == SPI_FLASH)
+		FLASH_DESEL;
+	else if (dev == SPI_SD)
+		SD_DESEL;
+	if (gSpi.owner == dev)
+		gSpi.owner = SPI_NONE;
+}
+
+// The interrupt engine is only built for 'J' to time it against polling. At
+// FCLK / 2 a byte takes 16 cycles, less than the ISR costs, so it gives no
+// time back to the main loop for the card or the flash.
+#define SPI_BENCH			0
+
+#if SPI_BENCH
+typedef void (*spi_done_t)(void);
+
+// A transfer of len bytes, sent from tx or as fill bytes if tx is 0, and
+// received into rx or thrown away if rx is 0. done is called when the last
+// byte is in, from the ISR for SpiStart(). The pointers and length are used
+// up as the transfer goes. The caller selects the device.
+typedef struct {
+	const uint8	*tx;
+	uint8		*rx;
+	uint16		len;
+	uint8		fill;
+	spi_done_t	done;
+} SPI_XFER;
+
+void	SpiStart(SPI_XFER *x);
+uint8	SpiBusy(void);
+void	SpiPolled(SPI_XFER *x);
+void	SpiBench(void);
+
+#define SPI_BENCH_BYTES		16384			// per measurement
+#define SPI_BENCH_MAX		64				// longest transfer
+#endif
+
+#endif
@@ -0,0 +1,193 @@
+//-----------------------------------------------------------------------------
+//	Turtle Board Atmel Code
+//	stats.c
+//	Run statistics kept in EEPROM, so programming times can be compared over
+//	months. The log is a ring so its writes are spread over the records; the
+//	sector counts are written no more often than the sectors they count.
+//-----------------------------------------------------------------------------
+#include <stdio.h>
+#include <string.h>
+#include <avr/eeprom.h>
+
+#include "platform.h"
+#include "Turtle.h"
+#include "sd.h"
+#include "flash.h"
+#include "stats.h"
+
+static STAT_REC EEMEM	eLog[STAT_LOG];
+static uint16 EEMEM		eCycles[STAT_SECTORS];
+
+static STAT_REC	sRec;							// the session being run
+static uint8	sState;							// STAT_CLOSED etc.
+static uint8	sSaved;							// where sRec is in eLog[], STAT_LOG if not yet
+static uint16	sPhase;							// Clock() at the start of the phase
+
+//-----------------------------------------------------------------------------
+//	Returns the index of the newest record, STAT_LOG if there are none
+//-----------------------------------------------------------------------------
+static uint8 Newest(void) {
+
+	uint8 i;
+
+	if (eeprom_read_word(&eLog[0].seq) == STAT_EMPTY)
+		return STAT_LOG;
+	for (i = 0; i < STAT_LOG - 1; i++)
+		if (eeprom_read_word(&eLog[i + 1].seq) != ((eeprom_read_word(&eLog[i].seq) + 1) & STAT_SEQ_MASK))
+			break;
+	return i;
+}
+
+//-----------------------------------------------------------------------------
+//	Called when a write or an erase starts. A session still open for a check
+//	that never came is already saved, so is just dropped.
+//-----------------------------------------------------------------------------
+void StatBegin(uint32 base) {
+
+	memset(&sRec, 0, sizeof(sRec));
+	sRec.sector = base >> FLASH_SECTOR_SHIFT;
+	sRec.card = CardType();
+	sPhase = Clock();
+	sSaved = STAT_LOG;
+	sState = STAT_RUNNING;
+}
+
+//-----------------------------------------------------------------------------
+//	Called when the write finishes or fails, size is what was written
+//-----------------------------------------------------------------------------
+void StatWritten(uint32 size, uint16 eraseTicks) {
+
+	if (sState != STAT_RUNNING)
+		return;
+	sRec.size = size;
+	sRec.erase = eraseTicks;
+	sRec.write = Clock() - sPhase;
+	sPhase = Clock();
+}
+
+//-----------------------------------------------------------------------------
+//	Called when a standalone erase finishes
+//-----------------------------------------------------------------------------
+void StatErased(void) {
+
+	if (sState != STAT_RUNNING)
+		return;
+	sRec.erase = Clock() - sPhase;
+}
+
+//-----------------------------------------------------------------------------
+//	Called when a check or verify starts. It belongs to the write before it
+//	if that's still open, otherwise it's a session of its own.
+//-----------------------------------------------------------------------------
+void StatCheckStart(uint32 base) {
+
+	if ((sState == STAT_CLOSED) || !sRec.size)
+		StatBegin(base);
+	sState = STAT_RUNNING;
+	sPhase = Clock();
+}
+
+//-----------------------------------------------------------------------------
+//	Called when a check or verify finishes
+//-----------------------------------------------------------------------------
+void StatChecked(uint32 errors) {
+
+	if (sState != STAT_RUNNING)
+		return;
+	sRec.check = Clock() - sPhase;
+	sRec.errors = (errors > 0xFF) ? 0xFF : errors;
+	sState = STAT_CHECKED;
+}
+
+//-----------------------------------------------------------------------------
+//	Called when a job finishes, saves the record if the job was part of the
+//	session. A write that passed waits for the check or verify that may
+//	follow, which updates the record in place; other jobs leave it alone.
+//	The sectors written are counted once, when the write is saved.
+//-----------------------------------------------------------------------------
+void StatEnd(uint8 failed) {
+
+	uint8 i, last, first;
+	uint16 n;
+
+	if ((sState == STAT_CLOSED) || (sState == STAT_WAITING))
+		return;
+	if (failed && !sRec.errors)
+		sRec.errors = 1;
+	sState = ((sState == STAT_RUNNING) && sRec.size && !sRec.errors) ? STAT_WAITING : STAT_CLOSED;
+
+	if ((first = ((i = sSaved) == STAT_LOG))) {
+		i = Newest();
+		if (i == STAT_LOG) {
+			i = 0;
+			sRec.seq = 0;
+		} else {
+			sRec.seq = (eeprom_read_word(&eLog[i].seq) + 1) & STAT_SEQ_MASK;
+			if (++i == STAT_LOG)
+				i = 0;
+		}
+		sSaved = i;
+	}
+	eeprom_update_block((uint8 *)&sRec + sizeof(sRec.seq), (uint8 *)&eLog[i] + sizeof(sRec.seq),
+		sizeof(sRec) - sizeof(sRec.seq));
+	eeprom_update_word(&eLog[i].seq, sRec.seq);					// last, so a torn record isn't the newest
+
+	if (!first || !sRec.size)
+		return;
+	last = (((uint32)sRec.sector << FLASH_SECTOR_SHIFT) + sRec.size - 1) >> FLASH_SECTOR_SHIFT;
+	for (i = sRec.sector; (i <= last) && (i < STAT_SECTORS); i++) {
+		n = eeprom_read_word(&eCycles[i]);
+		if (n == STAT_EMPTY)
+			n = 0;
+		if (n < STAT_EMPTY - 1)
+			eeprom_update_word(&eCycles[i], n + 1);
+	}
+}
+
+//-----------------------------------------------------------------------------
+static void PrintTicks(uint16 ticks) {
+
+	fprintf_P(fio, PSTR("%5u.%u"), ticks / TICK_FREQ, ticks % TICK_FREQ);
+}
+
+//-----------------------------------------------------------------------------
+//	Prints the log, oldest first, then the sector counts
+//-----------------------------------------------------------------------------
+void StatList(void) {
+
+	STAT_REC rec;
+	uint8 i, j, n;
+	uint16 c;
+
+	fputs_P(PSTR("    #  sector      kb  erase  write  check  errors  card\r\n"), fio);
+	if ((i = Newest()) == STAT_LOG)
+		fputs_P(PSTR("no sessions\r\n"), fio);
+	else {
+		for (n = 0; n < STAT_LOG; n++) {
+			if (++i == STAT_LOG)
+				i = 0;
+			eeprom_read_block(&rec, &eLog[i], sizeof(rec));
+			if (rec.seq == STAT_EMPTY)
+				continue;
+			fprintf_P(fio, PSTR("%5u  %6u  %6lu "), rec.seq, rec.sector, rec.size >> 10);
+			PrintTicks(rec.erase);
+			PrintTicks(rec.write);
+			PrintTicks(rec.check);
+			fprintf_P(fio, PSTR("  %6u  %S\r\n"), rec.errors,
+				(rec.card & CT_BLOCK) ? PSTR("SDHC") : (rec.card & CT_SD2) ? PSTR("SDv2") :
+				(rec.card & CT_SD1) ? PSTR("SDv1") : (rec.card & CT_MMC) ? PSTR("MMC") : PSTR("-"));
+		}
+	}
+
+	fputs_P(PSTR("\r\nTimes programmed, by 64k sector:\r\n"), fio);
+	for (i = 0, j = 0; i < STAT_SECTORS; i++) {
+		c = eeprom_read_word(&eCycles[i]);
+		if ((c == STAT_EMPTY) || !c)
+			continue;
+		fprintf_P(fio, PSTR("%3u:%-6u"), i, c);
+		if (!(++j & 7))
+			fputs_P(PSTR("\r\n"), fio);
+	}
+	if (j & 7)
+		fputs_P(PSTR("\r\n"), fio);
+}
@@ -0,0 +1,45 @@
+//-----------------------------------------------------------------------------
+//	Turtle Board Atmel Code
+//	stats.h
+//-----------------------------------------------------------------------------
+#ifndef STATS_H_
+#define STATS_H_
+
+#include "platform.h"
+
+void	StatBegin(uint32 base);
+void	StatWritten(uint32 size, uint16 eraseTicks);
+void	StatErased(void);
+void	StatCheckStart(uint32 base);
+void	StatChecked(uint32 errors);
+void	StatEnd(uint8 failed);
+void	StatList(void);
+
+// A session is a write and the check or verify that follows it, an erase, or
+// a verify with no write before it. The EEPROM keeps the last STAT_LOG of them
+// in a ring, the newest found by the sequence numbers, and a count of the
+// times each 64k sector of the flash has been programmed.
+#define STAT_LOG			24
+#define STAT_SECTORS		64				// 4MB
+#define STAT_EMPTY			0xFFFF			// erased EEPROM
+#define STAT_SEQ_MASK		0x7FFF			// so a sequence number is never empty
+
+// session states
+#define STAT_CLOSED			0
+#define STAT_RUNNING		1				// one of its jobs is running
+#define STAT_CHECKED		2				// checked, closes when the job ends
+#define STAT_WAITING		3				// written, open for a check or verify
+
+typedef struct {
+	uint16	seq;
+	uint32	size;
+	uint16	erase;							// ticks the write waited on erases
+	uint16	write;							// ticks, including the erases
+	uint16	check;							// ticks
+	uint8	errors;
+	uint8	card;							// CT_ flags
+	uint8	sector;							// of the start
+	uint8	spare;
+} STAT_REC;
+
+#endif
@@ -0,0 +1,94 @@
+//-----------------------------------------------------------------------------
+//	Turtle Board Atmel Code
+//	rlepack.c
+//	Host tool, compresses an FPGA image into fpga.rle for the programmer.
+//	The format is described in bitstream.h.
+//
+//	Build:	cc -O2 -o rlepack rlepack.c
+//	Use:	rlepack fpga.bin fpga.rle
+//-----------------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define RLE_MIN_RUN			3
+#define RLE_MAX_RUN			(0x7F + RLE_MIN_RUN)
+#define RLE_MAX_LITERAL		0x80
+
+//-----------------------------------------------------------------------------
+//	Length of the run of identical bytes at p, up to RLE_MAX_RUN
+//-----------------------------------------------------------------------------
+static long RunLength(const uint8_t *p, long left) {
+
+	long n = 1;
+
+	while ((n < left) && (n < RLE_MAX_RUN) && (p[n] == p[0]))
+		n++;
+	return n;
+}
+
+//-----------------------------------------------------------------------------
+static void PutLong(uint32_t v, FILE *f) {
+
+	for (int i = 0; i < 4; i++)
+		fputc((v >> (8 * i)) & 0xFF, f);
+}
+
+//-----------------------------------------------------------------------------
+int main(int argc, char *argv[]) {
+
+	FILE *in, *out;
+	uint8_t *data;
+	long size, i, run, lit, packed;
+
+	if (argc != 3) {
+		fprintf(stderr, "use: rlepack fpga.bin fpga.rle\n");
+		return 1;
+	}
+	if (!(in = fopen(argv[1], "rb"))) {
+		perror(argv[1]);
+		return 1;
+	}
+	fseek(in, 0, SEEK_END);
+	size = ftell(in);
+	rewind(in);
+	if (!(data = malloc(size ? size : 1)) || (fread(data, 1, size, in) != (size_t)size)) {
+		fprintf(stderr, "%s: read failed\n", argv[1]);
+		return 1;
+	}
+	fclose(in);
+
+	if (!(out = fopen(argv[2], "wb"))) {
+		perror(argv[2]);
+		return 1;
+	}
+	fputs("TRLE", out);
+	PutLong(size, out);
+
+	for (i = 0; i < size; ) {
+		run = RunLength(data + i, size - i);
+		if (run >= RLE_MIN_RUN) {
+			fputc(0x80 + run - RLE_MIN_RUN, out);
+			fputc(data[i], out);
+			i += run;
+			continue;
+		}
+
+		// literals up to the next run worth packing
+		for (lit = 0; (i + lit < size) && (lit < RLE_MAX_LITERAL); lit++)
+			if (RunLength(data + i + lit, size - i - lit) >= RLE_MIN_RUN)
+				break;
+		fputc(lit - 1, out);
+		fwrite(data + i, 1, lit, out);
+		i += lit;
+	}
+
+	packed = ftell(out);
+	if (fclose(out)) {
+		perror(argv[2]);
+		return 1;
+	}
+	printf("%ld -> %ld bytes (%ld%%)\n", size, packed, size ? packed * 100 / size : 0);
+	free(data);
+	return 0;
+}